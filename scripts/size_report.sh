@@ -0,0 +1,13 @@
+#!/usr/bin/env bash
+# Builds each firmware variant and prints its RAM and flash use.
+# Usage: scripts/size_report.sh [env ...]   (default: every variant)
+ENVS=${*:-"esp32-s3-devkitc-1 es8311-gc9a01 pcm5102-headless benchmark"}
+
+printf '%-22s %12s %12s\n' env ram_bytes flash_bytes
+for ENV in $ENVS; do
+  OUT=$(pio run -e "$ENV" 2>&1)
+  RAM=$(echo "$OUT" | grep '^RAM:' | sed -n 's/.*used \([0-9]*\) bytes.*/\1/p')
+  FLASH=$(echo "$OUT" | grep '^Flash:' | sed -n 's/.*used \([0-9]*\) bytes.*/\1/p')
+  printf '%-22s %12s %12s\n' "$ENV" "${RAM:-failed}" "${FLASH:-failed}"
+done
+
@@ -2,14 +2,14 @@
 
 #include "Audio.h"
 #include "es8311.h"
+#include "config.h"
 
-#define I2S_DOUT 8
-#define I2S_BCLK 9
-#define I2S_MCLK 16
-#define I2S_LRC 45
 #define PA_ENABLE 46
 #define ES_CODEC_I2C_SCL 14
 #define ES_CODEC_I2C_SDA 15
+// audio renders every codec to 16-bit PCM before it reaches I2S, so the
+// serial word length the codec sees never changes with the stream.
+#define I2S_SLOT_BITS 16
 
 Audio audio;
 ES8311 es;
@@ -24,4 +24,15 @@ void setupAudio()
     log_e("ES8311 begin failed");
   es.setVolume(70);
   es.setBitsPerSample(16);
-}
\ No newline at end of file
+}
+
+// Called from audio_info(): once the decoder reports a new sample rate, audio
+// retunes I2S (MCLK = 256 * fs) and the codec dividers have to follow.
+void syncAudioFormat()
+{
+  uint32_t sampleRate = audio.getSampleRate();
+  if (sampleRate == 0)
+    return;
+  if (!es.setFormat(sampleRate, I2S_SLOT_BITS))
+    log_e("ES8311 cannot switch to %u Hz", sampleRate);
+}
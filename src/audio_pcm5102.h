@@ -1,14 +1,16 @@
 #pragma once
 
 #include "Audio.h"
-
-#define I2S_DOUT 47
-#define I2S_BCLK 21
-#define I2S_LRC 38
+#include "config.h"
 
 Audio audio;
 
 void setupAudio()
 {
   audio.setPinout(I2S_BCLK, I2S_LRC, I2S_DOUT);
-}
\ No newline at end of file
+}
+
+void syncAudioFormat()
+{
+  // PCM5102 derives its clocks from BCK/LRCK, nothing to retune.
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <LittleFS.h>
+#include <esp_heap_caps.h>
+#include "streamtap.h"
+
+// Decoder benchmark, built with -DARADIO_BENCHMARK=1 (pio run -e benchmark).
+// Recorded streams in LittleFS /fixtures are served over loopback with their
+// ICY metadata still interleaved, then played through connectStream() like
+// any station, so the tap, relay and decoder all do their usual work.
+//
+// Fixture names are <label>.<icy-metaint>.<ext>, e.g. mp3-128k.16000.mp3;
+// test/record_fixture.sh records them and `pio run -t uploadfs` uploads data/.
+
+#define BENCHMARK_DIR "/fixtures"
+#define BENCHMARK_PORT 8082
+#define BENCHMARK_MAX_FIXTURES 12
+#define BENCHMARK_WARMUP_MS 3000
+#define BENCHMARK_MEASURE_MS 15000
+#define BENCHMARK_REPORT_SIZE 1024
+
+struct BenchmarkResult
+{
+  char label[40];
+  uint32_t chunks;
+  uint32_t usPerChunk;  // audio.loop() time per PCM chunk handed to I2S
+  uint32_t maxLoopUs;   // longest single audio.loop()
+  uint32_t peakHeap;    // internal RAM taken while playing
+  uint32_t peakPsram;
+  uint32_t headroomPct; // loop time left for display, web and everything else
+  uint32_t bitrate;
+};
+
+char benchmarkFixtures[BENCHMARK_MAX_FIXTURES][64];
+int benchmarkFixtureCount = 0;
+BenchmarkResult benchmarkResults[BENCHMARK_MAX_FIXTURES];
+int benchmarkResultCount = 0;
+
+int benchmarkCurrent = -1;
+uint32_t benchmarkStartMillis = 0;
+bool benchmarkMeasuring = false;
+uint32_t benchmarkMeasureStartUs = 0;
+uint32_t benchmarkLoopStartUs = 0;
+uint64_t benchmarkLoopUs = 0;
+uint32_t benchmarkMaxLoopUs = 0;
+volatile uint32_t benchmarkChunks = 0;
+size_t benchmarkHeapBaseline = 0, benchmarkHeapMin = 0;
+size_t benchmarkPsramBaseline = 0, benchmarkPsramMin = 0;
+
+const char *fixtureContentType(const char *name)
+{
+  const char *ext = strrchr(name, '.');
+  if (!ext)
+    return "audio/mpeg";
+  if (strcmp(ext, ".aac") == 0)
+    return "audio/aac";
+  if (strcmp(ext, ".m4a") == 0)
+    return "audio/mp4";
+  if (strcmp(ext, ".flac") == 0)
+    return "audio/flac";
+  if (strcmp(ext, ".ogg") == 0 || strcmp(ext, ".opus") == 0)
+    return "audio/ogg";
+  return "audio/mpeg";
+}
+
+// <label>.<metaint>.<ext>: label and metaint
+uint32_t fixtureMetaInt(const char *name, char *label, size_t labelSize)
+{
+  strlcpy(label, name, labelSize);
+  char *dot = strchr(label, '.');
+  if (!dot)
+    return 0;
+  *dot = '\0';
+  return strtoul(dot + 1, nullptr, 10);
+}
+
+void serveFixture(WiFiClient &client, const char *name)
+{
+  char path[96];
+  snprintf(path, sizeof(path), BENCHMARK_DIR "/%s", name);
+  File file = LittleFS.open(path, FILE_READ);
+  if (!file)
+  {
+    client.print("HTTP/1.0 404 Not Found\r\n\r\n");
+    return;
+  }
+
+  char label[40];
+  uint32_t metaInt = fixtureMetaInt(name, label, sizeof(label));
+  client.printf("ICY 200 OK\r\nContent-Type: %s\r\nicy-name: benchmark %s\r\n", fixtureContentType(name), label);
+  if (metaInt)
+    client.printf("icy-metaint: %u\r\n", (unsigned)metaInt);
+  client.print("\r\n");
+
+  // The recording already carries its metadata blocks at metaint spacing
+  static uint8_t buf[4096];
+  while (client.connected())
+  {
+    int n = file.read(buf, sizeof(buf));
+    if (n <= 0)
+      break;
+    if (client.write(buf, n) != (size_t)n)
+      break;
+  }
+  file.close();
+}
+
+void fixtureServerTask(void *param)
+{
+  WiFiServer server(BENCHMARK_PORT);
+  server.begin();
+  while (true)
+  {
+    WiFiClient client = server.available();
+    if (!client)
+    {
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
+    }
+    char line[128];
+    if (readHeaderLine(&client, line, sizeof(line)) && strncmp(line, "GET /", 5) == 0)
+    {
+      char *name = line + 5;
+      char *space = strchr(name, ' ');
+      if (space)
+        *space = '\0';
+      char header[128];
+      while (readHeaderLine(&client, header, sizeof(header)) && header[0] != '\0')
+        ;
+      serveFixture(client, name);
+    }
+    client.stop();
+  }
+}
+
+void setupBenchmark()
+{
+  File dir = LittleFS.open(BENCHMARK_DIR);
+  if (dir && dir.isDirectory())
+  {
+    File file;
+    while ((file = dir.openNextFile()) && benchmarkFixtureCount < BENCHMARK_MAX_FIXTURES)
+    {
+      if (!file.isDirectory())
+        strlcpy(benchmarkFixtures[benchmarkFixtureCount++], file.name(), sizeof(benchmarkFixtures[0]));
+      file.close();
+    }
+  }
+  if (benchmarkFixtureCount == 0)
+  {
+    Serial.println("benchmark   no fixtures in " BENCHMARK_DIR);
+    return;
+  }
+  xTaskCreatePinnedToCore(fixtureServerTask, "fixtureServer", 4096, NULL, 3, NULL, 0);
+}
+
+void startFixture(int index)
+{
+  benchmarkCurrent = index;
+  benchmarkMeasuring = false;
+  benchmarkStartMillis = millis();
+  // Before connecting, so decoder buffers and connect-time allocations count
+  benchmarkHeapBaseline = benchmarkHeapMin = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  benchmarkPsramBaseline = benchmarkPsramMin = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+
+  char url[128];
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d/%s", BENCHMARK_PORT, benchmarkFixtures[index]);
+  Serial.printf("benchmark   %s\n", benchmarkFixtures[index]);
+  connectStream(url);
+}
+
+void finishFixture()
+{
+  uint32_t wallUs = micros() - benchmarkMeasureStartUs;
+  BenchmarkResult &result = benchmarkResults[benchmarkResultCount++];
+  fixtureMetaInt(benchmarkFixtures[benchmarkCurrent], result.label, sizeof(result.label));
+  result.chunks = benchmarkChunks;
+  result.usPerChunk = benchmarkChunks ? benchmarkLoopUs / benchmarkChunks : 0;
+  result.maxLoopUs = benchmarkMaxLoopUs;
+  result.peakHeap = benchmarkHeapBaseline - benchmarkHeapMin;
+  result.peakPsram = benchmarkPsramBaseline - benchmarkPsramMin;
+  result.headroomPct = wallUs ? 100 - (uint32_t)(benchmarkLoopUs * 100 / wallUs) : 0;
+  result.bitrate = audio.getBitRate();
+  benchmarkMeasuring = false;
+  stopStream();
+}
+
+size_t formatBenchmark(char *dest, size_t size)
+{
+  size_t len = snprintf(dest, size, "%-16s %8s %8s %8s %8s %8s %5s %7s\n",
+                        "fixture", "chunks", "us/chunk", "max us", "heap", "psram", "room", "kbps");
+  for (int i = 0; i < benchmarkResultCount && len < size; i++)
+  {
+    const BenchmarkResult &r = benchmarkResults[i];
+    len += snprintf(dest + len, size - len, "%-16s %8u %8u %8u %8u %8u %4u%% %7u\n", r.label,
+                    (unsigned)r.chunks, (unsigned)r.usPerChunk, (unsigned)r.maxLoopUs,
+                    (unsigned)r.peakHeap, (unsigned)r.peakPsram, (unsigned)r.headroomPct,
+                    (unsigned)(r.bitrate / 1000));
+  }
+  return len < size ? len : size - 1;
+}
+
+// Runs the fixtures one after another and prints the table at the end
+void benchmarkLoop()
+{
+  if (benchmarkFixtureCount == 0 || benchmarkResultCount == benchmarkFixtureCount)
+    return;
+  if (benchmarkCurrent < 0)
+  {
+    startFixture(0);
+    return;
+  }
+
+  benchmarkHeapMin = min(benchmarkHeapMin, heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+  benchmarkPsramMin = min(benchmarkPsramMin, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+
+  uint32_t elapsed = millis() - benchmarkStartMillis;
+  if (!benchmarkMeasuring && elapsed >= BENCHMARK_WARMUP_MS)
+  {
+    benchmarkMeasuring = true;
+    benchmarkMeasureStartUs = micros();
+    benchmarkLoopUs = 0;
+    benchmarkMaxLoopUs = 0;
+    benchmarkChunks = 0;
+  }
+  if (!benchmarkMeasuring)
+    return;
+
+  if (elapsed < BENCHMARK_WARMUP_MS + BENCHMARK_MEASURE_MS)
+    return;
+
+  finishFixture();
+  if (benchmarkResultCount < benchmarkFixtureCount)
+  {
+    startFixture(benchmarkCurrent + 1);
+    return;
+  }
+
+  static char report[BENCHMARK_REPORT_SIZE];
+  formatBenchmark(report, sizeof(report));
+  Serial.print(report);
+}
+
+// Bracket audio.loop() with these
+void benchmarkBeforeAudio()
+{
+  benchmarkLoopStartUs = micros();
+}
+
+void benchmarkAfterAudio()
+{
+  if (!benchmarkMeasuring)
+    return;
+  uint32_t us = micros() - benchmarkLoopStartUs;
+  benchmarkLoopUs += us;
+  if (us > benchmarkMaxLoopUs)
+    benchmarkMaxLoopUs = us;
+}
+
+// From audio_process_i2s, once per PCM chunk. That is not once per codec
+// frame, so compare us/chunk between fixtures of the same codec only.
+void benchmarkChunk()
+{
+  if (benchmarkMeasuring)
+    benchmarkChunks++;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+// Build variant, chosen with -D flags in platformio.ini (one env per
+// variant). Hardware and optional features that bring code or globals of
+// their own (multiroom, benchmark, the logo decoders) are left out with #if
+// around their includes and call sites. Code that only branches on the
+// variant tests the constexprs below. With no flags this is the original
+// PCM5102 + SSD1306 radio.
+
+#define ARADIO_AUDIO_PCM5102 1
+#define ARADIO_AUDIO_ES8311 2
+
+#define ARADIO_DISPLAY_SERIAL 0
+#define ARADIO_DISPLAY_SSD1306 1
+#define ARADIO_DISPLAY_GC9A01 2
+
+#ifndef ARADIO_AUDIO
+#define ARADIO_AUDIO ARADIO_AUDIO_PCM5102
+#endif
+
+#ifndef ARADIO_DISPLAY
+#define ARADIO_DISPLAY ARADIO_DISPLAY_SSD1306
+#endif
+
+#ifndef ARADIO_MULTIROOM
+#define ARADIO_MULTIROOM 1
+#endif
+
+#ifndef ARADIO_LOGOS // needs JPEGDEC and PNGdec
+#define ARADIO_LOGOS 1
+#endif
+
+#ifndef ARADIO_BENCHMARK
+#define ARADIO_BENCHMARK 0
+#endif
+
+enum class AudioBackend
+{
+  PCM5102 = ARADIO_AUDIO_PCM5102,
+  ES8311 = ARADIO_AUDIO_ES8311,
+};
+
+enum class DisplayKind
+{
+  Serial = ARADIO_DISPLAY_SERIAL,
+  SSD1306 = ARADIO_DISPLAY_SSD1306,
+  GC9A01 = ARADIO_DISPLAY_GC9A01,
+};
+
+constexpr AudioBackend audioBackend = static_cast<AudioBackend>(ARADIO_AUDIO);
+constexpr DisplayKind displayKind = static_cast<DisplayKind>(ARADIO_DISPLAY);
+constexpr bool featureLogos = ARADIO_LOGOS;
+
+// I2S wiring of each audio board; MCLK only exists on the ES8311 board
+constexpr bool es8311Board = audioBackend == AudioBackend::ES8311;
+constexpr int I2S_DOUT = es8311Board ? 8 : 47;
+constexpr int I2S_BCLK = es8311Board ? 9 : 21;
+constexpr int I2S_LRC = es8311Board ? 45 : 38;
+constexpr int I2S_MCLK = es8311Board ? 16 : -1;
+
+static_assert(audioBackend == AudioBackend::PCM5102 || audioBackend == AudioBackend::ES8311, "Unknown ARADIO_AUDIO");
+static_assert(ARADIO_DISPLAY >= ARADIO_DISPLAY_SERIAL && ARADIO_DISPLAY <= ARADIO_DISPLAY_GC9A01, "Unknown ARADIO_DISPLAY");
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_wifi.h>
+#include "metrics.h"
+#include "streamtap.h"
+
+// Watches the Wi-Fi link while playing. A weak, weakening or flapping link
+// raises the tap's rebuffer target; a weak one also triggers a background scan and a
+// move to a stronger AP of the same network. Lost links are rejoined in
+// place, the stream tap reopens the upstream by itself meanwhile.
+
+#define LINK_SAMPLE_MS 1000
+#define LINK_DEGRADED_RSSI -72
+#define LINK_TREND_SAMPLES 10 // degrade early if the RSSI trend crosses the threshold within this many samples
+#define LINK_TROUBLE_HOLD_MS 30000 // stay degraded this long after a drop or upstream reconnect
+#define LINK_REJOIN_MS 10000
+#define ROAM_RSSI -70
+#define ROAM_HYSTERESIS_DB 8
+#define ROAM_SCAN_INTERVAL_MS 60000
+#define BUFFER_TARGET_GOOD_MS 2000
+#define BUFFER_TARGET_DEGRADED_MS 8000
+
+enum LinkState
+{
+  LINK_GOOD,
+  LINK_DEGRADED,
+  LINK_DOWN
+};
+
+volatile LinkState linkState = LINK_GOOD;
+volatile bool linkUp = false;
+volatile uint32_t linkDownMillis = 0;
+volatile uint32_t lastLinkTroubleMillis = 0;
+float rssiAverage = 0;
+float rssiTrend = 0; // dB per sample, averaged
+uint32_t lastLinkSample = 0;
+uint32_t lastRejoin = 0;
+uint32_t lastRoamScan = 0;
+bool roamScanning = false;
+uint32_t degradedSince = 0;
+uint32_t degradedMsBefore = 0;
+
+volatile uint32_t wifiRssiNeg = 0; // -dBm, metrics are unsigned
+volatile uint32_t wifiDisconnects = 0;
+volatile uint32_t wifiRoams = 0;
+volatile uint32_t wifiRejoins = 0;
+volatile uint32_t wifiDegradedMs = 0;
+
+void onWifiEvent(arduino_event_id_t event, arduino_event_info_t info)
+{
+  switch (event)
+  {
+  case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+    if (!linkUp && linkDownMillis)
+      Serial.printf("wifi        link back after %u ms\n", (unsigned)(millis() - linkDownMillis));
+    linkUp = true;
+    break;
+  case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+    if (linkUp)
+    {
+      Serial.printf("wifi        link lost, reason %u\n", info.wifi_sta_disconnected.reason);
+      wifiDisconnects++;
+      linkDownMillis = millis();
+    }
+    linkUp = false;
+    lastLinkTroubleMillis = millis();
+    break;
+  default:
+    break;
+  }
+}
+
+void setupConnectivity()
+{
+  WiFi.onEvent(onWifiEvent);
+  WiFi.setAutoReconnect(true);
+  registerMetric("wifi_rssi_neg_dbm", &wifiRssiNeg);
+  registerMetric("wifi_disconnects", &wifiDisconnects);
+  registerMetric("wifi_roams", &wifiRoams);
+  registerMetric("wifi_rejoins", &wifiRejoins);
+  registerMetric("wifi_degraded_ms", &wifiDegradedMs);
+}
+
+// Point the station config at `bssid` and reassociate. The pin is kept in
+// RAM only so a reboot can still pick any AP of the network.
+void roamTo(const uint8_t *bssid, int32_t channel)
+{
+  wifi_config_t conf;
+  if (esp_wifi_get_config(WIFI_IF_STA, &conf) != ESP_OK)
+    return;
+  conf.sta.bssid_set = 1;
+  memcpy(conf.sta.bssid, bssid, 6);
+  conf.sta.channel = channel;
+  esp_wifi_set_storage(WIFI_STORAGE_RAM);
+  esp_wifi_set_config(WIFI_IF_STA, &conf);
+  esp_wifi_set_storage(WIFI_STORAGE_FLASH);
+  Serial.printf("wifi        roaming to %02x:%02x:%02x:%02x:%02x:%02x ch %d\n",
+                bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5], (int)channel);
+  wifiRoams++;
+  esp_wifi_disconnect();
+  esp_wifi_connect();
+}
+
+// Drop any BSSID pin and rejoin whatever AP is best now
+void rejoin()
+{
+  wifi_config_t conf;
+  if (esp_wifi_get_config(WIFI_IF_STA, &conf) == ESP_OK && conf.sta.bssid_set)
+  {
+    conf.sta.bssid_set = 0;
+    conf.sta.channel = 0;
+    esp_wifi_set_storage(WIFI_STORAGE_RAM);
+    esp_wifi_set_config(WIFI_IF_STA, &conf);
+    esp_wifi_set_storage(WIFI_STORAGE_FLASH);
+  }
+  Serial.println("wifi        rejoining");
+  wifiRejoins++;
+  WiFi.reconnect();
+}
+
+void checkRoamScan()
+{
+  int16_t found = WiFi.scanComplete();
+  if (found == WIFI_SCAN_RUNNING)
+    return;
+  roamScanning = false;
+  if (found < 0 || !linkUp)
+  {
+    WiFi.scanDelete();
+    return;
+  }
+
+  String ssid = WiFi.SSID();
+  const uint8_t *current = WiFi.BSSID();
+  int32_t rssi = WiFi.RSSI();
+  int best = -1;
+  for (int i = 0; i < found; i++)
+  {
+    if (WiFi.SSID(i) != ssid || (current && memcmp(WiFi.BSSID(i), current, 6) == 0))
+      continue;
+    if (WiFi.RSSI(i) >= rssi + ROAM_HYSTERESIS_DB && (best < 0 || WiFi.RSSI(i) > WiFi.RSSI(best)))
+      best = i;
+  }
+  if (best >= 0)
+  {
+    uint8_t bssid[6];
+    memcpy(bssid, WiFi.BSSID(best), sizeof(bssid));
+    int32_t channel = WiFi.channel(best);
+    WiFi.scanDelete();
+    roamTo(bssid, channel);
+    return;
+  }
+  WiFi.scanDelete();
+}
+
+void connectivityLoop()
+{
+  if (roamScanning)
+    checkRoamScan();
+  if (millis() - lastLinkSample < LINK_SAMPLE_MS)
+    return;
+  lastLinkSample = millis();
+
+  LinkState state;
+  if (!linkUp)
+  {
+    state = LINK_DOWN;
+    if (millis() - linkDownMillis > LINK_REJOIN_MS && millis() - lastRejoin > LINK_REJOIN_MS)
+    {
+      lastRejoin = millis();
+      rejoin();
+    }
+  }
+  else
+  {
+    int32_t rssi = WiFi.RSSI();
+    float previous = rssiAverage;
+    rssiAverage = rssiAverage == 0 ? rssi : rssiAverage * 0.8f + rssi * 0.2f;
+    if (previous != 0)
+      rssiTrend = rssiTrend * 0.8f + (rssiAverage - previous) * 0.2f;
+    wifiRssiNeg = (uint32_t)-rssiAverage;
+    // Fading out (walking away from the AP): build the deeper buffer
+    // before the signal gets bad, not after
+    float rssiAhead = rssiAverage + min(rssiTrend, 0.0f) * LINK_TREND_SAMPLES;
+
+    uint32_t trouble = lastLinkTroubleMillis;
+    if (tapLastReconnectMillis && (int32_t)(tapLastReconnectMillis - trouble) > 0)
+      trouble = tapLastReconnectMillis;
+    bool recentTrouble = trouble && millis() - trouble < LINK_TROUBLE_HOLD_MS;
+    state = rssiAhead < LINK_DEGRADED_RSSI || recentTrouble ? LINK_DEGRADED : LINK_GOOD;
+
+    if (rssiAverage < ROAM_RSSI && !roamScanning && tapActive() &&
+        (lastRoamScan == 0 || millis() - lastRoamScan > ROAM_SCAN_INTERVAL_MS))
+    {
+      lastRoamScan = millis();
+      roamScanning = WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING;
+    }
+  }
+
+  if (state != linkState)
+  {
+    if (linkState == LINK_GOOD)
+      degradedSince = millis();
+    else if (state == LINK_GOOD)
+      degradedMsBefore += millis() - degradedSince;
+    linkState = state;
+    tapBufferTargetMs = state == LINK_GOOD ? BUFFER_TARGET_GOOD_MS : BUFFER_TARGET_DEGRADED_MS;
+  }
+  wifiDegradedMs = degradedMsBefore + (linkState == LINK_GOOD ? 0 : millis() - degradedSince);
+}
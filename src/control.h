@@ -0,0 +1,179 @@
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "Audio.h"
+#include "epromAddreses.h"
+#include "metrics.h"
+#include "streamtap.h"
+#include "timeshift.h"
+
+// Control commands from the web routes are recorded here and carried out
+// by controlLoop() on the main task, next to audio.loop(), so the AsyncTCP
+// task never blocks on the tap or touches the decoder. Of /play and /stop
+// the last request wins, and a burst of /play requests only plays the last
+// URL; of pause, resume and seek only the last one runs. Volume is applied at once but written to flash at most
+// every VOLUME_PERSIST_INTERVAL_MS.
+
+#define PLAY_COALESCE_MS 1000 // also the pause between stopping and reconnecting
+#define VOLUME_PERSIST_INTERVAL_MS 5000
+
+extern Audio audio;
+
+portMUX_TYPE controlMux = portMUX_INITIALIZER_UNLOCKED;
+char pendingPlayURL[256] = "";
+volatile bool playPending = false;
+volatile bool stopPending = false;
+volatile uint32_t playRequestedMillis = 0;
+bool playStopped = false;
+
+enum TimeshiftAction : uint8_t
+{
+  TIMESHIFT_NONE,
+  TIMESHIFT_PAUSE,
+  TIMESHIFT_RESUME,
+  TIMESHIFT_SEEK,
+};
+
+volatile TimeshiftAction pendingTimeshift = TIMESHIFT_NONE;
+volatile uint32_t pendingSeekSeconds = 0;
+
+volatile int pendingVolume = -1;
+uint32_t lastVolumePersistMillis = 0;
+
+volatile uint32_t controlPlaysCoalesced = 0;
+volatile uint32_t controlPlaysExecuted = 0;
+volatile uint32_t controlVolumeWrites = 0;
+
+void setupControl()
+{
+  registerMetric("control_plays_coalesced", &controlPlaysCoalesced);
+  registerMetric("control_plays_executed", &controlPlaysExecuted);
+  registerMetric("control_volume_writes", &controlVolumeWrites);
+}
+
+void queuePlay(const char *url)
+{
+  portENTER_CRITICAL(&controlMux);
+  if (playPending)
+    controlPlaysCoalesced++;
+  strlcpy(pendingPlayURL, url, sizeof(pendingPlayURL));
+  playRequestedMillis = millis();
+  playPending = true;
+  stopPending = false;
+  pendingTimeshift = TIMESHIFT_NONE; // meant for the stream being replaced
+  portEXIT_CRITICAL(&controlMux);
+}
+
+// Replaces a pending /play, if any. Returns false when there was neither a
+// pending play nor a stream to stop.
+bool queueStop()
+{
+  bool playing = audio.isRunning() || tapActive() || timeshiftPaused;
+  portENTER_CRITICAL(&controlMux);
+  bool stoppable = playing || playPending || stopPending;
+  if (stoppable)
+  {
+    playPending = false;
+    stopPending = true;
+    pendingTimeshift = TIMESHIFT_NONE;
+  }
+  portEXIT_CRITICAL(&controlMux);
+  return stoppable;
+}
+
+// Drops a pending /play or /stop; the scheduler is taking over playback
+void cancelPendingPlay()
+{
+  portENTER_CRITICAL(&controlMux);
+  playPending = false;
+  stopPending = false;
+  portEXIT_CRITICAL(&controlMux);
+}
+
+void queueTimeshift(TimeshiftAction action, uint32_t seekSeconds = 0)
+{
+  portENTER_CRITICAL(&controlMux);
+  pendingTimeshift = action;
+  pendingSeekSeconds = seekSeconds;
+  portEXIT_CRITICAL(&controlMux);
+}
+
+void setVolumeDeferred(int volume)
+{
+  audio.setVolume(volume);
+  portENTER_CRITICAL(&controlMux);
+  pendingVolume = volume;
+  portEXIT_CRITICAL(&controlMux);
+}
+
+void controlLoop()
+{
+  if (stopPending)
+  {
+    portENTER_CRITICAL(&controlMux);
+    stopPending = false;
+    portEXIT_CRITICAL(&controlMux);
+    stopStream();
+    EEPROM.writeString(LAST_URL_EPROM_ADDEESS, "");
+    EEPROM.commit();
+  }
+
+  if (playPending)
+  {
+    if (!playStopped)
+    {
+      stopStream();
+      playStopped = true;
+    }
+    if (millis() - playRequestedMillis >= PLAY_COALESCE_MS)
+    {
+      char url[sizeof(pendingPlayURL)];
+      portENTER_CRITICAL(&controlMux);
+      strlcpy(url, pendingPlayURL, sizeof(url));
+      playPending = false;
+      portEXIT_CRITICAL(&controlMux);
+      playStopped = false;
+
+      controlPlaysExecuted++;
+      if (connectStream(url))
+      {
+        EEPROM.writeString(LAST_URL_EPROM_ADDEESS, url);
+        EEPROM.commit();
+      }
+      else
+        Serial.printf("Failed to connect to: %s\n", url);
+    }
+  }
+  else
+    playStopped = false;
+
+  if (pendingTimeshift != TIMESHIFT_NONE)
+  {
+    portENTER_CRITICAL(&controlMux);
+    TimeshiftAction action = pendingTimeshift;
+    uint32_t seconds = pendingSeekSeconds;
+    pendingTimeshift = TIMESHIFT_NONE;
+    portEXIT_CRITICAL(&controlMux);
+
+    bool done = action == TIMESHIFT_PAUSE    ? timeshiftPause()
+                : action == TIMESHIFT_RESUME ? timeshiftResume()
+                                             : timeshiftSeek(seconds);
+    if (!done)
+      Serial.printf("Timeshift action %d not possible now\n", (int)action);
+  }
+
+  int volume = pendingVolume;
+  if (volume >= 0 && millis() - lastVolumePersistMillis >= VOLUME_PERSIST_INTERVAL_MS)
+  {
+    EEPROM.writeInt(VOLUME_EPROM_ADDRESS, volume);
+    EEPROM.commit();
+    // A volume set during the commit stays pending for the next write
+    portENTER_CRITICAL(&controlMux);
+    if (pendingVolume == volume)
+      pendingVolume = -1;
+    portEXIT_CRITICAL(&controlMux);
+    lastVolumePersistMillis = millis();
+    controlVolumeWrites++;
+  }
+}
@@ -3,6 +3,7 @@
 #include "SPI.h"
 #include "Audio.h"
 #include <Arduino_GFX_Library.h>
+#include "utf8text.h"
 
 #define TFT_DC 47
 #define TFT_CS 5
@@ -10,6 +11,7 @@
 #define TFT_MOSI 2
 #define TFT_RST 38
 #define TFT_BL 42
+#define TFT_BL_ON LOW
 
 #define TFT_WIDTH 240
 #define TFT_HEIGHT 240
@@ -27,8 +29,9 @@ void setupDisplay()
 {
     Serial.println("Initializing cg display...");
     pinMode(TFT_BL, OUTPUT);
-    digitalWrite(TFT_BL, LOW);
+    digitalWrite(TFT_BL, TFT_BL_ON);
     tft->begin();
+    tft->cp437(true);
     tft->fillScreen(BLACK);
     backBuffer = new Arduino_Canvas(240, 240, tft);
     if (!backBuffer->begin())
@@ -40,8 +43,19 @@ void setupDisplay()
     backBuffer->fillScreen(BLACK);
 }
 
-void showText(const String &status)
+void displaySleep(bool sleep)
 {
+    digitalWrite(TFT_BL, sleep ? !TFT_BL_ON : TFT_BL_ON);
+    if (sleep)
+        tft->displayOff();
+    else
+        tft->displayOn();
+}
+
+void showText(const char *status)
+{
+    static char text[128];
+    displayText(text, sizeof(text), status);
 
     tft->fillScreen(BLACK);
     tft->setTextColor(BLUE);
@@ -49,24 +63,29 @@ void showText(const String &status)
 
     int16_t x1, y1;
     uint16_t w, h;
-    tft->getTextBounds(status, 0, 0, &x1, &y1, &w, &h);
+    tft->getTextBounds(text, 0, 0, &x1, &y1, &w, &h);
 
     int16_t x = (TFT_WIDTH - w) / 2;
     int16_t y = (TFT_HEIGHT - h) / 2;
 
     tft->setCursor(x, y);
-    tft->println(status);
+    tft->println(text);
 }
 
-void setStatus(const String &status, bool isTop = true)
+// status is UTF-8; 20 glyphs fill the width at text size 2 and longer
+// text wraps, so keep up to four lines
+void setStatus(const char *status, bool isTop = true)
 {
+    static char text[81];
+    displayText(text, sizeof(text), status);
+
     tft->fillScreen(BLACK);
     tft->setTextColor(WHITE);
     tft->setTextSize(2);
 
     int16_t x1, y1;
     uint16_t w, h;
-    tft->getTextBounds(status, 0, 0, &x1, &y1, &w, &h);
+    tft->getTextBounds(text, 0, 0, &x1, &y1, &w, &h);
 
     int16_t x = (TFT_WIDTH - w) / 2;
     int16_t y;
@@ -81,27 +100,36 @@ void setStatus(const String &status, bool isTop = true)
 
     tft->fillRect(0, y, TFT_WIDTH, h, BLACK);
     tft->setCursor(x, y);
-    tft->println(status);
+    tft->println(text);
 }
 
-void drawVUMeter()
+void drawVUMeter(bool outline)
 {
     uint16_t level = audio.getVUlevel();
     uint16_t minRadius = 0;
     uint16_t maxRadius = TFT_HEIGHT - 100;
     uint16_t radius = map(level, 0, 40000, minRadius, maxRadius);
 
-    backBuffer->fillCircle(TFT_WIDTH / 2, TFT_HEIGHT / 2, radius, GREEN);
+    // Over a station logo only the ring is drawn so the artwork stays visible
+    if (outline)
+        backBuffer->drawCircle(TFT_WIDTH / 2, TFT_HEIGHT / 2, radius, GREEN);
+    else
+        backBuffer->fillCircle(TFT_WIDTH / 2, TFT_HEIGHT / 2, radius, GREEN);
 }
 
 void scrollText()
 {
 }
 
+const uint16_t *currentLogoPixels();
+
 void displayLoop()
 {
     backBuffer->fillScreen(BLACK);
-    drawVUMeter();
+    const uint16_t *logo = currentLogoPixels();
+    if (logo)
+        backBuffer->draw16bitRGBBitmap(0, 0, (uint16_t *)logo, TFT_WIDTH, TFT_HEIGHT);
+    drawVUMeter(logo != nullptr);
     scrollText();
     backBuffer->flush();
 }
@@ -2,6 +2,7 @@
 
 #include <Adafruit_GFX.h>
 #include <Adafruit_SSD1306.h>
+#include "utf8text.h"
 
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 32
@@ -10,10 +11,6 @@
 #define OLED_RESET -1
 #define SCREEN_ADDRESS 0x3C
 
-#define I2S_DOUT 47
-#define I2S_BCLK 21
-#define I2S_LRC 38
-
 int topStatusTextWidth = 0;
 int bottomStatusTextWidth = 0;
 int topStatusTextX = 0;
@@ -42,44 +39,55 @@ void setupDisplay()
     ESP.restart();
   }
   display.setTextColor(SSD1306_WHITE);
+  display.cp437(true);
   display.ssd1306_command(SSD1306_SETCONTRAST);
   display.ssd1306_command(0x01);
   topStatusTextX = SCREEN_WIDTH;
   bottomStatusTextX = SCREEN_WIDTH;
 }
 
-void showText(const String &status)
+void displaySleep(bool sleep)
 {
+  display.ssd1306_command(sleep ? SSD1306_DISPLAYOFF : SSD1306_DISPLAYON);
+}
+
+void showText(const char *status)
+{
+  static char text[128];
+  displayText(text, sizeof(text), status);
+
   display.clearDisplay();
   display.setTextSize(1);
   display.setTextWrap(true);
   int16_t x1, y1;
   uint16_t w, h;
 
-  display.getTextBounds(status, 0, 0, &x1, &y1, &w, &h);
+  display.getTextBounds(text, 0, 0, &x1, &y1, &w, &h);
 
   int16_t x = (SCREEN_WIDTH - w) / 2;
   int16_t y = (SCREEN_HEIGHT - h) / 2;
 
   display.setCursor(x, y);
-  display.println(status);
+  display.println(text);
   display.display();
 }
 
-void setStatus(const String &status, bool isTop = true)
+// status is UTF-8; the buffers hold font glyphs, one byte per character
+void setStatus(const char *status, bool isTop = true)
 {
   char *targetStatus = isTop ? topStatus : bottomStatus;
   size_t bufSize = isTop ? sizeof(topStatus) : sizeof(bottomStatus);
 
+  size_t len = 0;
+  if (isTop)
+    len = snprintf(targetStatus, bufSize, "%s - ", localWebUIURL);
+  if (len >= bufSize - 1)
+    len = bufSize - 2;
+  len += displayText(targetStatus + len, bufSize - len - 1, status);
   if (isTop)
   {
-    snprintf(targetStatus, bufSize, "%s - %s ", localWebUIURL, status);
-  }
-  else
-  {
-
-    strncpy(targetStatus, status.c_str(), bufSize - 1);
-    targetStatus[bufSize - 1] = '\0';
+    targetStatus[len] = ' ';
+    targetStatus[len + 1] = '\0';
   }
 
   display.setTextWrap(false);
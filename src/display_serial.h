@@ -7,14 +7,18 @@ void setupDisplay()
     Serial.println("Display setup not implemented.");
 }
 
-void showText(const String &status)
+void displaySleep(bool sleep)
 {
-    Serial.println("Display showText not implemented: " + status);
 }
 
-void setStatus(const String &status, bool isTop = true)
+void showText(const char *status)
 {
-    Serial.println("Display setStatus not implemented: " + status + " isTop: " + (isTop ? "true" : "false"));
+    Serial.printf("Display showText not implemented: %s\n", status);
+}
+
+void setStatus(const char *status, bool isTop = true)
+{
+    Serial.printf("Display setStatus not implemented: %s isTop: %s\n", status, isTop ? "true" : "false");
 }
 
 void displayLoop()
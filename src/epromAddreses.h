@@ -3,5 +3,9 @@
 
 int VOLUME_EPROM_ADDRESS = 300;
 int LAST_URL_EPROM_ADDEESS = 0;
+int IP_CACHE_EPROM_ADDRESS = 310; // magic, ip, gateway, subnet, dns
+int MULTIROOM_ROLE_EPROM_ADDRESS = 330;
+int TIMEZONE_EPROM_ADDRESS = 340; // 64 bytes, POSIX TZ string
+int ALARMS_EPROM_ADDRESS = 512;   // MAX_ALARMS * sizeof(Alarm)
 
-#endif 
\ No newline at end of file
+#endif 
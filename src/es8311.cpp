@@ -31,7 +31,7 @@
 #include "es8311.h"
 
 /* codec hifi mclk clock divider coefficients */
-static const struct _coeff_div coeff_div[] = {
+static constexpr struct _coeff_div coeff_div[] = {
     /*!<mclk     rate   pre_div  mult  adc_div dac_div fs_mode lrch  lrcl  bckdiv osr */
     /* 8k */
     {12288000, 8000, 0x06, 0x00, 0x01, 0x01, 0x00, 0x00, 0xff, 0x04, 0x10, 0x10},
@@ -134,6 +134,47 @@ static const struct _coeff_div coeff_div[] = {
     {1536000, 96000, 0x01, 0x03, 0x01, 0x01, 0x01, 0x00, 0x7f, 0x02, 0x10, 0x10},
 };
 
+static constexpr size_t COEFF_DIV_COUNT = sizeof(coeff_div) / sizeof(coeff_div[0]);
+
+static constexpr uint64_t coeff_key(uint32_t mclk, uint32_t rate){
+    return ((uint64_t)mclk << 32) | rate;
+}
+
+/* coeff_div[] indices sorted by (mclk, rate), built at compile time */
+struct _coeff_lut {
+    struct {
+        uint64_t key;
+        uint8_t index;
+    } entries[COEFF_DIV_COUNT];
+};
+
+static constexpr _coeff_lut build_coeff_lut(){
+    _coeff_lut lut{};
+    for (size_t i = 0; i < COEFF_DIV_COUNT; i++) {
+        const uint64_t key = coeff_key(coeff_div[i].mclk, coeff_div[i].rate);
+        size_t j = i;
+        while (j > 0 && lut.entries[j - 1].key > key) {
+            lut.entries[j] = lut.entries[j - 1];
+            j--;
+        }
+        lut.entries[j].key = key;
+        lut.entries[j].index = (uint8_t)i;
+    }
+    return lut;
+}
+
+static constexpr _coeff_lut coeff_lut = build_coeff_lut();
+
+static constexpr bool coeff_lut_unique(){
+    for (size_t i = 1; i < COEFF_DIV_COUNT; i++) {
+        if (coeff_lut.entries[i - 1].key == coeff_lut.entries[i].key) {return false;}
+    }
+    return true;
+}
+
+static_assert(COEFF_DIV_COUNT <= 256, "coeff_div[] index must fit in uint8_t");
+static_assert(coeff_lut_unique(), "duplicate (mclk, rate) entry in coeff_div[]");
+
 ES8311::ES8311(TwoWire *TwoWireInstance){
     _TwoWireInstance = TwoWireInstance;
 }
@@ -148,10 +189,15 @@ ES8311::~ES8311(){
 * look for the coefficient in coeff_div[] table
 */
 int ES8311::get_coeff(uint32_t mclk, uint32_t rate){
-    for (int i = 0; i < (sizeof(coeff_div) / sizeof(coeff_div[0])); i++) {
-        if (coeff_div[i].rate == rate && coeff_div[i].mclk == mclk) {
-            return i;
-        }
+    const uint64_t key = coeff_key(mclk, rate);
+    size_t lo = 0, hi = COEFF_DIV_COUNT;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (coeff_lut.entries[mid].key < key) {lo = mid + 1;}
+        else {                                  hi = mid;}
+    }
+    if (lo < COEFF_DIV_COUNT && coeff_lut.entries[lo].key == key) {
+        return coeff_lut.entries[lo].index;
     }
     return -1;
 }
@@ -226,6 +272,7 @@ bool ES8311::setSampleRate(uint32_t sample_rate){
     if (coeff < 0) {log_e("Invalid sample rate %i", sample_rate); return false;}
     const struct _coeff_div *const selected_coeff = &coeff_div[coeff];
     reg = ReadReg(0x02);
+    reg &= 0x07; // Clear previous pre_div and pre_multi
     reg |= (selected_coeff->pre_div - 1) << 5;
     reg |= selected_coeff->pre_multi << 3;
     ok |= WriteReg(0x02, reg); // Set pre_div and pre_multi
@@ -244,12 +291,13 @@ bool ES8311::setSampleRate(uint32_t sample_rate){
     reg |= selected_coeff->lrck_h << 0;
     ok |= WriteReg(0x07, reg); // Set lrck_h
     ok |= WriteReg(0x08, selected_coeff->lrck_l); // Set lrck_l
+    _sample_rate = sample_rate;
     return ok;
 }
 
 bool ES8311::setBitsPerSample(uint8_t bps){
-    uint8_t reg09 = ReadReg(0x09);
-    uint8_t reg0A = ReadReg(0x0A);
+    uint8_t reg09 = ReadReg(0x09) & ~(7 << 2); // Clear previous word length
+    uint8_t reg0A = ReadReg(0x0A) & ~(7 << 2);
     switch (bps) {
         case 16: reg09 |= (3 << 2); reg0A |= (3 << 2); break;
         case 18: reg09 |= (2 << 2); reg0A |= (2 << 2); break;
@@ -260,9 +308,30 @@ bool ES8311::setBitsPerSample(uint8_t bps){
     }
     bool ok = WriteReg(0x09, reg09);
     ok |= WriteReg(0x0A, reg0A);
+    _bps = bps;
     return ok;
 }
 
+/*
+* Retune clock dividers and word length for a new stream format. The DAC is
+* soft-muted while the dividers change so the switch does not click.
+*/
+bool ES8311::setFormat(uint32_t sample_rate, uint8_t bps){
+    if (sample_rate == _sample_rate && bps == _bps) {return true;}
+    bool ok = setMute(true);
+    ok &= setSampleRate(sample_rate);
+    ok &= setBitsPerSample(bps);
+    ok &= setMute(false);
+    return ok;
+}
+
+bool ES8311::setMute(bool mute){
+    uint8_t reg = ReadReg(0x31);
+    if (mute) {reg |= BIT(6) | BIT(5);}
+    else {     reg &= ~(BIT(6) | BIT(5));}
+    return WriteReg(0x31, reg);
+}
+
 bool ES8311::enableMicrophone(bool enable){
     uint8_t reg = 0x1A; // enable analog MIC and max PGA gain
     if (enable) {
@@ -27,6 +27,8 @@ class ES8311{
 private:
     TwoWire *_TwoWireInstance = NULL;	// TwoWire Instance
     uint32_t _mclk_hz = 48000 * 256; // default MCLK frequency
+    uint32_t _sample_rate = 0;       // currently programmed sample rate
+    uint8_t _bps = 0;                // currently programmed word length
 public:
 	// Constructor.
     ES8311(TwoWire  *TwoWireInstance = &Wire);
@@ -36,6 +38,8 @@ public:
     uint8_t getVolume();
     bool setSampleRate(uint32_t sample_rate);
     bool setBitsPerSample(uint8_t bps);
+    bool setFormat(uint32_t sample_rate, uint8_t bps);
+    bool setMute(bool mute);
     bool enableMicrophone(bool enable);
     bool setMicrophoneGain(uint8_t gain);
     uint8_t getMicrophoneGain();
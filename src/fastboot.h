@@ -0,0 +1,235 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <EEPROM.h>
+#include <esp_wifi.h>
+#include <ping/ping_sock.h>
+#include <esp_netif.h>
+#include <esp_netif_net_stack.h>
+#include <lwip/etharp.h>
+#include <lwip/tcpip.h>
+#include "epromAddreses.h"
+#include "metrics.h"
+
+#define FAST_BOOT_WIFI_TIMEOUT_MS 8000
+#define FAST_BOOT_CACHE_IP 1
+#define FAST_BOOT_PING_TIMEOUT_MS 1500
+#define FAST_BOOT_ARP_PROBES 2
+#define FAST_BOOT_ARP_WAIT_MS 300
+#define IP_CACHE_MAGIC 0xA4AD10C1
+
+// Milliseconds since power-on at which each boot phase finished
+volatile uint32_t bootWifiMs = 0;
+volatile uint32_t bootStreamConnectMs = 0;
+volatile uint32_t bootAudioMs = 0;
+volatile uint32_t bootDisplayMs = 0;
+volatile uint32_t bootWebServerMs = 0;
+
+void markBoot(volatile uint32_t &stamp, const char *phase)
+{
+  if (stamp != 0)
+    return;
+  stamp = millis();
+  Serial.printf("boot        %s at %u ms\n", phase, (unsigned)stamp);
+}
+
+void registerBootMetrics()
+{
+  registerMetric("boot_wifi_ms", &bootWifiMs);
+  registerMetric("boot_stream_connect_ms", &bootStreamConnectMs);
+  registerMetric("boot_audio_ms", &bootAudioMs);
+  registerMetric("boot_display_ms", &bootDisplayMs);
+  registerMetric("boot_webserver_ms", &bootWebServerMs);
+}
+
+bool hasStoredWifiCredentials()
+{
+  wifi_config_t conf;
+  if (esp_wifi_get_config(WIFI_IF_STA, &conf) != ESP_OK)
+    return false;
+  return conf.sta.ssid[0] != '\0';
+}
+
+bool applyCachedIP()
+{
+#if FAST_BOOT_CACHE_IP
+  if (EEPROM.readUInt(IP_CACHE_EPROM_ADDRESS) != IP_CACHE_MAGIC)
+    return false;
+  IPAddress ip(EEPROM.readUInt(IP_CACHE_EPROM_ADDRESS + 4));
+  IPAddress gateway(EEPROM.readUInt(IP_CACHE_EPROM_ADDRESS + 8));
+  IPAddress subnet(EEPROM.readUInt(IP_CACHE_EPROM_ADDRESS + 12));
+  IPAddress dns(EEPROM.readUInt(IP_CACHE_EPROM_ADDRESS + 16));
+  return WiFi.config(ip, gateway, subnet, dns);
+#else
+  return false;
+#endif
+}
+
+// Remember the DHCP lease so the next boot can skip DHCP entirely
+void saveCachedIP()
+{
+#if FAST_BOOT_CACHE_IP
+  uint32_t ip = WiFi.localIP();
+  if (EEPROM.readUInt(IP_CACHE_EPROM_ADDRESS) == IP_CACHE_MAGIC &&
+      EEPROM.readUInt(IP_CACHE_EPROM_ADDRESS + 4) == ip)
+    return;
+  EEPROM.writeUInt(IP_CACHE_EPROM_ADDRESS, IP_CACHE_MAGIC);
+  EEPROM.writeUInt(IP_CACHE_EPROM_ADDRESS + 4, ip);
+  EEPROM.writeUInt(IP_CACHE_EPROM_ADDRESS + 8, (uint32_t)WiFi.gatewayIP());
+  EEPROM.writeUInt(IP_CACHE_EPROM_ADDRESS + 12, (uint32_t)WiFi.subnetMask());
+  EEPROM.writeUInt(IP_CACHE_EPROM_ADDRESS + 16, (uint32_t)WiFi.dnsIP());
+  EEPROM.commit();
+#endif
+}
+
+void clearCachedIP()
+{
+  EEPROM.writeUInt(IP_CACHE_EPROM_ADDRESS, 0);
+  EEPROM.commit();
+  WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+}
+
+void gatewayPingDone(esp_ping_handle_t ping, void *args)
+{
+  xSemaphoreGive((SemaphoreHandle_t)args);
+}
+
+// A cached address that still associates can belong to a different
+// network (new router, other subnet). The gateway not answering shows that;
+// it says nothing about whether the address is taken, see cachedIPInUse().
+bool gatewayReachable()
+{
+  SemaphoreHandle_t done = xSemaphoreCreateBinary();
+  esp_ping_config_t config = ESP_PING_DEFAULT_CONFIG();
+  ip_addr_set_ip4_u32(&config.target_addr, (uint32_t)WiFi.gatewayIP());
+  config.count = 3;
+  config.interval_ms = 200;
+  config.timeout_ms = 400;
+
+  esp_ping_callbacks_t callbacks = {};
+  callbacks.cb_args = done;
+  callbacks.on_ping_success = gatewayPingDone;
+  callbacks.on_ping_end = gatewayPingDone;
+
+  esp_ping_handle_t ping;
+  if (esp_ping_new_session(&config, &callbacks, &ping) != ESP_OK)
+  {
+    vSemaphoreDelete(done);
+    return true; // cannot tell, keep the cached address
+  }
+  esp_ping_start(ping);
+  xSemaphoreTake(done, pdMS_TO_TICKS(FAST_BOOT_PING_TIMEOUT_MS));
+  esp_ping_stop(ping);
+
+  uint32_t received = 0;
+  esp_ping_get_profile(ping, ESP_PING_PROF_REPLY, &received, sizeof(received));
+  esp_ping_delete_session(ping);
+  vSemaphoreDelete(done);
+  return received > 0;
+}
+
+struct ArpProbe
+{
+  struct netif *netif;
+  ip4_addr_t ip;
+  bool answered;
+  SemaphoreHandle_t done;
+};
+
+// Both run in the lwIP thread
+void arpProbeSend(void *arg)
+{
+  ArpProbe *probe = (ArpProbe *)arg;
+  etharp_request(probe->netif, &probe->ip);
+  xSemaphoreGive(probe->done);
+}
+
+void arpProbeCheck(void *arg)
+{
+  ArpProbe *probe = (ArpProbe *)arg;
+  struct eth_addr *mac;
+  const ip4_addr_t *ip;
+  probe->answered = etharp_find_addr(probe->netif, &probe->ip, &mac, &ip) >= 0;
+  xSemaphoreGive(probe->done);
+}
+
+// The DHCP server may have given the cached lease to another device while
+// we were off. Ask who has our own address: we never answer our own ARP
+// request, so any entry for it afterwards is another host's.
+bool cachedIPInUse()
+{
+  esp_netif_t *sta = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  ArpProbe probe = {};
+  probe.netif = sta ? (struct netif *)esp_netif_get_netif_impl(sta) : nullptr;
+  if (!probe.netif)
+    return false;
+  ip4_addr_set_u32(&probe.ip, (uint32_t)WiFi.localIP());
+  probe.done = xSemaphoreCreateBinary();
+
+  for (int i = 0; i < FAST_BOOT_ARP_PROBES && !probe.answered; i++)
+  {
+    if (tcpip_callback(arpProbeSend, &probe) != ERR_OK)
+      break;
+    xSemaphoreTake(probe.done, portMAX_DELAY);
+    vTaskDelay(pdMS_TO_TICKS(FAST_BOOT_ARP_WAIT_MS));
+    if (tcpip_callback(arpProbeCheck, &probe) != ERR_OK)
+      break;
+    xSemaphoreTake(probe.done, portMAX_DELAY);
+  }
+  vSemaphoreDelete(probe.done);
+  return probe.answered;
+}
+
+bool waitForWifi()
+{
+  uint32_t start = millis();
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    if (millis() - start >= FAST_BOOT_WIFI_TIMEOUT_MS)
+      return false;
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  return true;
+}
+
+// Join the last network with the credentials the Wi-Fi driver kept in NVS,
+// without WiFiManager or the display. Returns false if the portal is needed.
+bool startWifiFast()
+{
+  WiFi.mode(WIFI_STA);
+  if (!hasStoredWifiCredentials())
+    return false;
+
+  bool cachedIP = applyCachedIP();
+  WiFi.begin();
+
+  if (!waitForWifi())
+  {
+    Serial.println("Fast Wi-Fi connect timed out");
+    WiFi.disconnect();
+    if (cachedIP)
+      clearCachedIP();
+    return false;
+  }
+
+  if (cachedIP && (!gatewayReachable() || cachedIPInUse()))
+  {
+    // Stale cache: forget it and join again with DHCP
+    Serial.println("Cached IP stale or taken, falling back to DHCP");
+    WiFi.disconnect();
+    clearCachedIP();
+    WiFi.begin();
+    if (!waitForWifi())
+    {
+      Serial.println("Fast Wi-Fi connect timed out");
+      WiFi.disconnect();
+      return false;
+    }
+    cachedIP = false;
+  }
+
+  if (!cachedIP)
+    saveCachedIP();
+  return true;
+}
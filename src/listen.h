@@ -0,0 +1,105 @@
+#pragma once
+
+#include <ESPAsyncWebServer.h>
+#include "streamtap.h"
+#include "metrics.h"
+#include "responsepool.h"
+
+// /listen fans the tap ring out to LAN clients. Each listener is just a
+// cursor into the shared ring; AsyncTCP pulls from it whenever that client's
+// send window opens, so a slow client only holds back itself. One that falls
+// a whole ring behind is dropped.
+
+#define LISTEN_MAX_CLIENTS 8
+#define LISTEN_PREROLL_BYTES (64 * 1024) // lets players start without waiting for live data
+
+struct Listener
+{
+  bool used;
+  uint32_t cursor;
+  uint32_t generation;
+};
+
+// Only touched from the AsyncTCP task, which runs handlers and fillers
+Listener listeners[LISTEN_MAX_CLIENTS];
+
+volatile uint32_t listenClients = 0;
+volatile uint32_t listenDropped = 0;
+volatile uint32_t listenBytesTotal = 0;
+
+void setupListen()
+{
+  registerMetric("listen_clients", &listenClients);
+  registerMetric("listen_dropped", &listenDropped);
+  registerMetric("listen_bytes_total", &listenBytesTotal);
+}
+
+int acquireListener()
+{
+  for (int i = 0; i < LISTEN_MAX_CLIENTS; i++)
+  {
+    if (!listeners[i].used)
+    {
+      uint32_t start = tapHead > LISTEN_PREROLL_BYTES ? tapHead - LISTEN_PREROLL_BYTES : 0;
+      if ((int32_t)(tapOldestOffset() - start) > 0)
+        start = tapOldestOffset();
+      listeners[i].used = true;
+      listeners[i].cursor = start;
+      listeners[i].generation = tapGeneration;
+      listenClients++;
+      return i;
+    }
+  }
+  return -1;
+}
+
+void releaseListener(int slot)
+{
+  if (!listeners[slot].used)
+    return;
+  listeners[slot].used = false;
+  listenClients--;
+}
+
+size_t fillListener(int slot, uint8_t *buffer, size_t maxLen)
+{
+  Listener &listener = listeners[slot];
+  if (listener.generation != tapGeneration || !tapActive())
+    return 0; // station changed or stopped, the client reconnects
+
+  int n = tapReadRing(listener.cursor, buffer, maxLen);
+  if (n < 0)
+  {
+    listenDropped++;
+    return 0;
+  }
+  if (n == 0)
+    return RESPONSE_TRY_AGAIN;
+  listener.cursor += n;
+  listenBytesTotal += n;
+  return n;
+}
+
+void handleListen(AsyncWebServerRequest *request)
+{
+  if (!tapActive())
+  {
+    sendText(request, 503, "Not playing a tappable stream");
+    return;
+  }
+  int slot = acquireListener();
+  if (slot < 0)
+  {
+    sendText(request, 503, "Too many listeners");
+    return;
+  }
+
+  request->onDisconnect([slot]()
+                        { releaseListener(slot); });
+  AsyncWebServerResponse *resp = request->beginChunkedResponse(tapContentType, [slot](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                                               { return fillListener(slot, buffer, maxLen); });
+  if (tapStationName[0])
+    resp->addHeader("icy-name", tapStationName);
+  resp->addHeader("Cache-Control", "no-cache");
+  request->send(resp);
+}
@@ -3,21 +3,33 @@
 #include <WiFiManager.h>
 #include <ESPmDNS.h>
 #include <EEPROM.h>
+#include "config.h"
 #include "webroutes.h"
 #include "epromAddreses.h"
+#include "fastboot.h"
+#include "connectivity.h"
+#include "utf8text.h"
 
-// #include "display_serial.h"
-
-// #include "display_gc9a01a.h"
-//#include "audio_es8311.h"
-
+// Only the selected hardware's headers are included, so other display and
+// codec libraries are never compiled (see lib_ignore in platformio.ini)
+#if ARADIO_DISPLAY == ARADIO_DISPLAY_GC9A01
+#include "display_gc9a01a.h"
+#elif ARADIO_DISPLAY == ARADIO_DISPLAY_SSD1306
 #include "display_sdd1306.h"
+#else
+#include "display_serial.h"
+#endif
+
+#if ARADIO_AUDIO == ARADIO_AUDIO_ES8311
+#include "audio_es8311.h"
+#else
 #include "audio_pcm5102.h"
+#endif
 
 
 #define ENABLE_MDNS 0
 
-#define EEPROM_SIZE 512
+#define EEPROM_SIZE 1024
 
 
 String deviceName = "ARadio";
@@ -32,6 +44,12 @@ char lastStreamURL[256] = "";
 
 char localWebUIURL[200] = "";
 
+volatile bool displayReady = false;
+volatile bool wifiReady = false; // joined, with the address we keep
+volatile bool servicesReady = false;
+bool mdnsStarted = false;
+bool wifiFastConnected = false;
+
 void setupWifi()
 {
   showText("Connecting to WiFi...");
@@ -39,7 +57,10 @@ void setupWifi()
   bool res;
 
   wm.setAPCallback([](WiFiManager *myWiFiManager)
-                   { showText("Configure Wifi. Connect to: " + String(deviceName) + " Pass: " + String(devicePassword)); });
+                   {
+                     char text[96];
+                     snprintf(text, sizeof(text), "Configure Wifi. Connect to: %s Pass: %s", deviceName.c_str(), devicePassword.c_str());
+                     showText(text); });
 
   res = wm.autoConnect(deviceName.c_str(), devicePassword.c_str());
 
@@ -53,20 +74,66 @@ void setupWifi()
   else
   {
     showText("Connected to Wifi");
+    saveCachedIP();
   }
+}
 
+void updateWebUIURL()
+{
   String hostName = WiFi.localIP().toString();
-
-  if (MDNS.begin(deviceName.c_str()))
-  {
 #if ENABLE_MDNS
+  if (mdnsStarted)
     hostName = deviceName + ".local";
 #endif
-  }
-
   snprintf(localWebUIURL, sizeof(localWebUIURL), "http://%s", hostName.c_str());
 }
 
+void setupMDNS()
+{
+  mdnsStarted = MDNS.begin(deviceName.c_str());
+  updateWebUIURL();
+}
+
+// Everything the stream does not need runs here, in parallel with the
+// Wi-Fi join and stream connect on the main task.
+void bootServicesTask(void *param)
+{
+  setupDisplay();
+  markBoot(bootDisplayMs, "display");
+  displayReady = true;
+
+  // Not just associated: a cached address may still be swapped for DHCP
+  while (!wifiReady)
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+  setupMDNS();
+  setupPower();
+  setupWebServer();
+  markBoot(bootWebServerMs, "web server");
+
+  servicesReady = true;
+  vTaskDelete(NULL);
+}
+
+void showBootStatus()
+{
+  if (strlen(lastStreamURL) > 0)
+  {
+    char text[sizeof(lastStreamURL) + 12];
+    snprintf(text, sizeof(text), "Resuming: %s", lastStreamURL);
+    setStatus(text, true);
+    if (strlen(stationName) > 0)
+      setStatus(stationName, true);
+    if (strlen(stationTitle) > 0)
+      setStatus(stationTitle, false);
+  }
+  else
+  {
+    setStatus("No previous stream found", true);
+    setStatus(localWebUIURL, false);
+  }
+}
+
 void setup()
 {
 
@@ -75,11 +142,11 @@ void setup()
   Serial.print("Total PSRAM: ");
   Serial.println(ESP.getPsramSize());
 
-  setupDisplay();
-  setupAudio();
-  setupWifi();
-
   EEPROM.begin(EEPROM_SIZE);
+  EEPROM.readString(LAST_URL_EPROM_ADDEESS, lastStreamURL, sizeof(lastStreamURL));
+  registerBootMetrics();
+
+  setupAudio();
 
   int volume = EEPROM.readInt(VOLUME_EPROM_ADDRESS);
   Serial.print("Volume from EEPROM: ");
@@ -93,26 +160,91 @@ void setup()
     audio.setVolume(12);
   }
 
-  setupWebServer();
-
-  EEPROM.readString(0, lastStreamURL, sizeof(lastStreamURL));
+  setupConnectivity();
+  // A later DHCP lease (rejoin, lease change) must show up on the display
+  WiFi.onEvent([](arduino_event_id_t event, arduino_event_info_t info)
+               {
+                 if (servicesReady)
+                   updateWebUIURL(); },
+               ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  xTaskCreatePinnedToCore(bootServicesTask, "bootServices", 8192, NULL, 1, NULL, 0);
 
-  if (strlen(lastStreamURL) > 0)
+  wifiFastConnected = startWifiFast();
+  if (!wifiFastConnected)
   {
-    audio.connecttohost(lastStreamURL);
-    setStatus("Resuming: " + String(lastStreamURL), true);
+    // The captive portal needs the display to tell the user what to do
+    while (!displayReady)
+      vTaskDelay(pdMS_TO_TICKS(10));
+    setupWifi();
   }
-  else
+  wifiReady = true;
+  markBoot(bootWifiMs, "wifi");
+
+  setupStreamTap();
+  setupTimeshift();
+  setupMetadata();
+#if ARADIO_MULTIROOM
+  setupMultiroom();
+#endif
+  setupScheduler();
+
+#if ARADIO_BENCHMARK
+  setupBenchmark();
+#else
+  if (strlen(lastStreamURL) > 0 && !multiroomFollowing())
   {
-    setStatus("No previous stream found", true);
-    setStatus(localWebUIURL, false);
+    connectStream(lastStreamURL);
+    markBoot(bootStreamConnectMs, "stream connect");
   }
+#endif
 }
 
 void loop()
 {
+  if (!servicesReady)
+  {
+    // Still booting: keep the stream going, leave the rest to bootServicesTask
+    audio.loop();
+    tapLoop();
+#if ARADIO_MULTIROOM
+    multiroomLoop();
+#endif
+    vTaskDelay(1);
+    return;
+  }
+
+  static bool bootStatusShown = false;
+  if (!bootStatusShown)
+  {
+    showBootStatus();
+    bootStatusShown = true;
+  }
+
+  controlLoop();
+  schedulerLoop();
+  connectivityLoop();
+  powerLoop();
+  if (powerState == POWER_IDLE)
+  {
+    vTaskDelay(pdMS_TO_TICKS(IDLE_LOOP_DELAY_MS));
+    return;
+  }
+
   vTaskDelay(1);
-  audio.loop();
+#if ARADIO_BENCHMARK
+  benchmarkLoop();
+  benchmarkBeforeAudio();
+#endif
+  if (!multiroomHoldAudio())
+    audio.loop();
+#if ARADIO_BENCHMARK
+  benchmarkAfterAudio();
+#endif
+  tapLoop();
+#if ARADIO_MULTIROOM
+  multiroomLoop();
+#endif
+  metadataLoop();
   static unsigned long lastScroll = 0;
   if (millis() - lastScroll >= 250)
   {
@@ -125,11 +257,13 @@ void audio_info(const char *info)
 {
   Serial.print("info        ");
   Serial.println(info);
+  syncAudioFormat();
 }
 void audio_id3data(const char *info)
 {
   Serial.print("id3data     ");
   Serial.println(info);
+  metadataId3(info);
 }
 void audio_eof_mp3(const char *info)
 {
@@ -140,22 +274,24 @@ void audio_showstation(const char *info)
 {
   Serial.print("station     ");
   Serial.println(info);
-  strncpy(stationName, info, sizeof(stationName) - 1);
-  stationName[sizeof(stationName) - 1] = '\0';
-  setStatus(stationName, true);
+  utf8Copy(stationName, sizeof(stationName), info);
+  if (displayReady)
+    setStatus(stationName, true);
 }
 void audio_showstreamtitle(const char *info)
 {
   Serial.print("streamtitle ");
   Serial.println(info);
-  strncpy(stationTitle, info, sizeof(stationTitle) - 1);
-  stationTitle[sizeof(stationTitle) - 1] = '\0';
-  setStatus(stationTitle, false);
+  utf8Copy(stationTitle, sizeof(stationTitle), info);
+  metadataTitle(stationTitle);
+  if (displayReady)
+    setStatus(stationTitle, false);
 }
 void audio_bitrate(const char *info)
-{
+{ // first decoded frame header
   Serial.print("bitrate     ");
   Serial.println(info);
+  markBoot(bootAudioMs, "audio");
 }
 void audio_commercial(const char *info)
 { // duration in sec
@@ -167,6 +303,21 @@ void audio_icyurl(const char *info)
   Serial.print("icyurl      ");
   Serial.println(info);
 }
+void audio_process_i2s(int16_t *outBuff, int32_t validSamples, uint8_t bitsPerSample, uint8_t channels, bool *continueI2S)
+{ // decoded PCM on its way to I2S
+#if ARADIO_MULTIROOM
+  multiroomProcessI2S(validSamples, continueI2S);
+#endif
+#if ARADIO_BENCHMARK
+  benchmarkChunk();
+#endif
+}
+void audio_icylogo(const char *info)
+{ // streams played directly, tapped streams get icy-logo from the tap
+  Serial.print("icylogo     ");
+  Serial.println(info);
+  requestLogo(info);
+}
 void audio_lasthost(const char *info)
 { // stream URL played
   Serial.print("lasthost    ");
@@ -0,0 +1,617 @@
+#pragma once
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#include "config.h"
+#if ARADIO_LOGOS
+#include <JPEGDEC.h>
+#include <PNGdec.h>
+#endif
+#include "metrics.h"
+#include "streamtap.h"
+#include "scheduler.h"
+#include "utf8text.h"
+
+// Title history and station logos. Titles from ICY metadata or ID3 tags go
+// into a small history ring. Each station logo is fetched once by logoTask,
+// decoded (JPEG or PNG) and scaled to fit a 240x240 RGB565 thumbnail. The
+// thumbnail is stored as a ready-to-send BMP in an LRU cache in PSRAM, with
+// copies in LittleFS so a reboot does not fetch them again.
+
+#define HISTORY_SIZE 20
+#define LOGO_SIZE 240
+#define LOGO_CACHE_ENTRIES 8
+#define LOGO_FLASH_ENTRIES 6
+#define LOGO_DIR "/logos"
+#define LOGO_MAX_BYTES (512 * 1024)
+#define LOGO_MAX_PNG_WIDTH 1024
+#define LOGO_FETCH_TIMEOUT_MS 8000
+#define LOGO_QUEUE_LENGTH 4
+#define BMP_HEADER_SIZE 66 // file header, BITMAPINFOHEADER and RGB565 masks
+#define LOGO_BMP_SIZE (BMP_HEADER_SIZE + LOGO_SIZE * LOGO_SIZE * 2)
+
+struct HistoryEntry
+{
+  uint32_t time; // epoch seconds, 0 before NTP sync
+  char station[64];
+  char title[160];
+};
+
+enum LogoState : uint8_t
+{
+  LOGO_EMPTY,
+  LOGO_LOADING,
+  LOGO_READY,
+  LOGO_FAILED, // remembered so a broken logo is not fetched again
+};
+
+struct LogoEntry
+{
+  uint32_t key; // hash of the source URL
+  uint32_t lastUsed;
+  volatile LogoState state;
+  volatile uint8_t inFlight; // responses still sending from bmp
+  uint8_t bmp[LOGO_BMP_SIZE];
+};
+
+struct LogoRequest
+{
+  char url[256];
+};
+
+HistoryEntry *history = nullptr;
+int historyCount = 0;
+int historyNext = 0;
+volatile uint32_t historyVersion = 0;
+char id3Artist[80] = "";
+
+LogoEntry *logoCache = nullptr;
+volatile uint32_t currentLogoKey = 0;
+SemaphoreHandle_t metadataLock = nullptr;
+QueueHandle_t logoQueue = nullptr;
+
+portMUX_TYPE logoMux = portMUX_INITIALIZER_UNLOCKED;
+char pendingLogoURL[256] = "";
+// Logos /logo?src= may serve: the last /play logo and recent stations'
+uint32_t recentLogoKeys[LOGO_CACHE_ENTRIES] = {};
+int recentLogoNext = 0;
+
+volatile uint32_t logoFetches = 0;
+volatile uint32_t logoFailures = 0;
+volatile uint32_t logoDecodeMsLast = 0;
+
+extern char stationName[];
+
+uint32_t logoKey(const char *url)
+{
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (; *url; url++)
+    hash = (hash ^ (uint8_t)*url) * 16777619u;
+  return hash ? hash : 1;
+}
+
+// --- history ---
+
+void addHistory(const char *title)
+{
+  if (!history || !title[0])
+    return;
+  // Compare what will be stored, so long titles cut to size still match
+  char station[sizeof(HistoryEntry::station)], clean[sizeof(HistoryEntry::title)];
+  utf8Copy(station, sizeof(station), stationName);
+  utf8Copy(clean, sizeof(clean), title);
+  xSemaphoreTake(metadataLock, portMAX_DELAY);
+  int last = (historyNext + HISTORY_SIZE - 1) % HISTORY_SIZE;
+  if (historyCount == 0 || strcmp(history[last].title, clean) != 0 || strcmp(history[last].station, station) != 0)
+  {
+    HistoryEntry &entry = history[historyNext];
+    entry.time = timeValid() ? time(nullptr) : 0;
+    strcpy(entry.station, station);
+    strcpy(entry.title, clean);
+    historyNext = (historyNext + 1) % HISTORY_SIZE;
+    if (historyCount < HISTORY_SIZE)
+      historyCount++;
+    historyVersion++;
+  }
+  xSemaphoreGive(metadataLock);
+}
+
+void metadataTitle(const char *title)
+{
+  addHistory(title);
+}
+
+// ID3 frames arrive one per callback as "Artist: ...", "Title: ..."
+void metadataId3(const char *info)
+{
+  if (strncmp(info, "Artist: ", 8) == 0)
+    utf8Copy(id3Artist, sizeof(id3Artist), info + 8);
+  else if (strncmp(info, "Title: ", 7) == 0)
+  {
+    char title[160];
+    if (id3Artist[0])
+      snprintf(title, sizeof(title), "%s - %s", id3Artist, info + 7);
+    else
+      strlcpy(title, info + 7, sizeof(title));
+    addHistory(title);
+  }
+}
+
+void jsonEscape(const char *src, char *dest, size_t destSize)
+{
+  size_t j = 0;
+  for (; *src && j + 7 < destSize; src++)
+  {
+    uint8_t c = *src;
+    if (c == '"' || c == '\\')
+    {
+      dest[j++] = '\\';
+      dest[j++] = c;
+    }
+    else if (c < 0x20)
+      j += snprintf(dest + j, destSize - j, "\\u%04x", c);
+    else
+      dest[j++] = c;
+  }
+  dest[j] = '\0';
+}
+
+// Newest first: [{"time":1700000000,"station":"...","title":"..."},...]
+size_t formatHistory(char *dest, size_t size)
+{
+  size_t len = snprintf(dest, size, "[");
+  xSemaphoreTake(metadataLock, portMAX_DELAY);
+  for (int i = 0; i < historyCount && len < size; i++)
+  {
+    const HistoryEntry &entry = history[(historyNext + HISTORY_SIZE - 1 - i) % HISTORY_SIZE];
+    char station[sizeof(entry.station) * 2], title[sizeof(entry.title) * 2];
+    jsonEscape(entry.station, station, sizeof(station));
+    jsonEscape(entry.title, title, sizeof(title));
+    len += snprintf(dest + len, size - len, "%s{\"time\":%u,\"station\":\"%s\",\"title\":\"%s\"}",
+                    i ? "," : "", (unsigned)entry.time, station, title);
+  }
+  xSemaphoreGive(metadataLock);
+  if (len < size)
+    len += snprintf(dest + len, size - len, "]");
+  return len < size ? len : size - 1;
+}
+
+// --- logo cache ---
+
+void writeBmpHeader(uint8_t *bmp)
+{
+  auto put16 = [&](int at, uint16_t v)
+  { bmp[at] = v; bmp[at + 1] = v >> 8; };
+  auto put32 = [&](int at, uint32_t v)
+  { put16(at, v); put16(at + 2, v >> 16); };
+  memset(bmp, 0, BMP_HEADER_SIZE);
+  bmp[0] = 'B';
+  bmp[1] = 'M';
+  put32(2, LOGO_BMP_SIZE);
+  put32(10, BMP_HEADER_SIZE);
+  put32(14, 40);
+  put32(18, LOGO_SIZE);
+  put32(22, (uint32_t)-LOGO_SIZE); // negative height: rows top-down, same as the display
+  put16(26, 1);
+  put16(28, 16);
+  put32(30, 3); // BI_BITFIELDS
+  put32(34, LOGO_SIZE * LOGO_SIZE * 2);
+  put32(38, 2835);
+  put32(42, 2835);
+  put32(54, 0xF800);
+  put32(58, 0x07E0);
+  put32(62, 0x001F);
+}
+
+uint16_t *logoPixels(LogoEntry *entry)
+{
+  return (uint16_t *)(entry->bmp + BMP_HEADER_SIZE);
+}
+
+// Caller holds metadataLock
+LogoEntry *findLogo(uint32_t key)
+{
+  if (!logoCache)
+    return nullptr;
+  for (int i = 0; i < LOGO_CACHE_ENTRIES; i++)
+    if (logoCache[i].state != LOGO_EMPTY && logoCache[i].key == key)
+      return &logoCache[i];
+  return nullptr;
+}
+
+// Caller holds metadataLock
+LogoEntry *allocateLogo(uint32_t key)
+{
+  LogoEntry *victim = nullptr;
+  for (int i = 0; i < LOGO_CACHE_ENTRIES; i++)
+  {
+    LogoEntry &entry = logoCache[i];
+    if (entry.inFlight || entry.state == LOGO_LOADING || (entry.state != LOGO_EMPTY && entry.key == currentLogoKey))
+      continue;
+    if (!victim || entry.state == LOGO_EMPTY || (victim->state != LOGO_EMPTY && entry.lastUsed < victim->lastUsed))
+      victim = &entry;
+  }
+  if (victim)
+  {
+    victim->state = LOGO_LOADING;
+    victim->key = key;
+    victim->lastUsed = millis();
+  }
+  return victim;
+}
+
+// Ready thumbnail for `key`, pinned until releaseLogo(); nullptr otherwise
+LogoEntry *acquireLogo(uint32_t key, LogoState *state)
+{
+  xSemaphoreTake(metadataLock, portMAX_DELAY);
+  LogoEntry *entry = findLogo(key);
+  *state = entry ? entry->state : LOGO_EMPTY;
+  if (entry && entry->state == LOGO_READY)
+  {
+    entry->inFlight++;
+    entry->lastUsed = millis();
+  }
+  else
+    entry = nullptr;
+  xSemaphoreGive(metadataLock);
+  return entry;
+}
+
+void releaseLogo(LogoEntry *entry)
+{
+  xSemaphoreTake(metadataLock, portMAX_DELAY);
+  entry->inFlight--;
+  xSemaphoreGive(metadataLock);
+}
+
+// For the display; only valid for the current station's logo
+const uint16_t *currentLogoPixels()
+{
+  if (!logoCache || currentLogoKey == 0)
+    return nullptr;
+  for (int i = 0; i < LOGO_CACHE_ENTRIES; i++)
+    if (logoCache[i].state == LOGO_READY && logoCache[i].key == currentLogoKey)
+      return logoPixels(&logoCache[i]);
+  return nullptr;
+}
+
+// Queues a fetch of the logo at `url` unless it is already cached or being
+// fetched. False when the queue is full.
+bool prefetchLogo(const char *url)
+{
+  if (!logoCache || !url[0])
+    return false;
+  xSemaphoreTake(metadataLock, portMAX_DELAY);
+  bool known = findLogo(logoKey(url)) != nullptr;
+  xSemaphoreGive(metadataLock);
+  if (known)
+    return true;
+  LogoRequest request;
+  strlcpy(request.url, url, sizeof(request.url));
+  return xQueueSend(logoQueue, &request, 0) == pdTRUE;
+}
+
+void rememberLogo(uint32_t key)
+{
+  portENTER_CRITICAL(&logoMux);
+  bool known = false;
+  for (int i = 0; i < LOGO_CACHE_ENTRIES; i++)
+    known |= recentLogoKeys[i] == key;
+  if (!known)
+  {
+    recentLogoKeys[recentLogoNext] = key;
+    recentLogoNext = (recentLogoNext + 1) % LOGO_CACHE_ENTRIES;
+  }
+  portEXIT_CRITICAL(&logoMux);
+}
+
+// True for the logo of the current, a recent or the next station, so
+// /logo?src= cannot be used to make the radio fetch arbitrary URLs
+bool logoAllowed(uint32_t key)
+{
+  if (key == currentLogoKey)
+    return true;
+  bool known = false;
+  portENTER_CRITICAL(&logoMux);
+  for (int i = 0; i < LOGO_CACHE_ENTRIES; i++)
+    known |= recentLogoKeys[i] == key;
+  portEXIT_CRITICAL(&logoMux);
+  return known;
+}
+
+// Asks for the logo at `url` and makes it the current one
+void requestLogo(const char *url)
+{
+  if (!logoCache || !url[0])
+  {
+    currentLogoKey = 0;
+    return;
+  }
+  currentLogoKey = logoKey(url);
+  rememberLogo(currentLogoKey);
+  prefetchLogo(url);
+}
+
+// Logo given with /play, used when the next stream starts
+void setPlayLogo(const char *url)
+{
+  if (url[0])
+    rememberLogo(logoKey(url));
+  portENTER_CRITICAL(&logoMux);
+  strlcpy(pendingLogoURL, url, sizeof(pendingLogoURL));
+  portEXIT_CRITICAL(&logoMux);
+}
+
+// --- decoding ---
+
+// Where the source image lands in the thumbnail: scaled to fit, centred
+uint16_t *decodeTarget = nullptr;
+int decodeSrcW, decodeSrcH, decodeDstW, decodeDstH, decodeOffX, decodeOffY;
+
+void fitLogo(uint16_t *target, int srcW, int srcH)
+{
+  decodeTarget = target;
+  decodeSrcW = srcW;
+  decodeSrcH = srcH;
+  if (srcW >= srcH)
+  {
+    decodeDstW = LOGO_SIZE;
+    decodeDstH = max(1, srcH * LOGO_SIZE / srcW);
+  }
+  else
+  {
+    decodeDstH = LOGO_SIZE;
+    decodeDstW = max(1, srcW * LOGO_SIZE / srcH);
+  }
+  decodeOffX = (LOGO_SIZE - decodeDstW) / 2;
+  decodeOffY = (LOGO_SIZE - decodeDstH) / 2;
+  memset(target, 0, LOGO_SIZE * LOGO_SIZE * 2);
+}
+
+// Nearest-neighbour copy of a decoded source block into the thumbnail
+void blitLogo(const uint16_t *src, int stride, int x, int y, int w, int h)
+{
+  w = min(w, decodeSrcW - x);
+  h = min(h, decodeSrcH - y);
+  if (w <= 0 || h <= 0)
+    return;
+  int dx0 = (x * decodeDstW + decodeSrcW - 1) / decodeSrcW;
+  int dx1 = ((x + w) * decodeDstW + decodeSrcW - 1) / decodeSrcW;
+  int dy0 = (y * decodeDstH + decodeSrcH - 1) / decodeSrcH;
+  int dy1 = ((y + h) * decodeDstH + decodeSrcH - 1) / decodeSrcH;
+  for (int dy = dy0; dy < dy1; dy++)
+  {
+    const uint16_t *row = src + (dy * decodeSrcH / decodeDstH - y) * stride;
+    uint16_t *dest = decodeTarget + (decodeOffY + dy) * LOGO_SIZE + decodeOffX;
+    for (int dx = dx0; dx < dx1; dx++)
+      dest[dx] = row[dx * decodeSrcW / decodeDstW - x];
+  }
+}
+
+#if ARADIO_LOGOS
+uint16_t pngLine[LOGO_MAX_PNG_WIDTH];
+
+int jpegDraw(JPEGDRAW *draw)
+{
+  blitLogo(draw->pPixels, draw->iWidth, draw->x, draw->y, draw->iWidth, draw->iHeight);
+  return 1;
+}
+
+PNG *pngDecoder = nullptr;
+
+int pngDraw(PNGDRAW *draw)
+{
+  pngDecoder->getLineAsRGB565(draw, pngLine, PNG_RGB565_LITTLE_ENDIAN, 0x00000000);
+  blitLogo(pngLine, draw->iWidth, 0, draw->y, draw->iWidth, 1);
+  return 1;
+}
+
+bool decodeLogo(uint8_t *data, size_t len, uint16_t *target)
+{
+  static JPEGDEC *jpeg = new (ps_malloc(sizeof(JPEGDEC))) JPEGDEC();
+  if (!pngDecoder)
+    pngDecoder = new (ps_malloc(sizeof(PNG))) PNG();
+
+  if (len > 3 && data[0] == 0xFF && data[1] == 0xD8)
+  {
+    if (!jpeg->openRAM(data, len, jpegDraw))
+      return false;
+    // Let the decoder drop resolution while it still leaves >= LOGO_SIZE
+    static const int scales[] = {0, JPEG_SCALE_HALF, JPEG_SCALE_QUARTER, JPEG_SCALE_EIGHTH};
+    int shift = 0;
+    while (shift < 3 && (jpeg->getWidth() >> (shift + 1)) >= LOGO_SIZE && (jpeg->getHeight() >> (shift + 1)) >= LOGO_SIZE)
+      shift++;
+    fitLogo(target, jpeg->getWidth() >> shift, jpeg->getHeight() >> shift);
+    jpeg->setPixelType(RGB565_LITTLE_ENDIAN);
+    bool ok = jpeg->decode(0, 0, scales[shift]);
+    jpeg->close();
+    return ok;
+  }
+  if (len > 8 && memcmp(data, "\x89PNG", 4) == 0)
+  {
+    if (pngDecoder->openRAM(data, len, pngDraw) != PNG_SUCCESS)
+      return false;
+    bool ok = false;
+    if (pngDecoder->getWidth() <= LOGO_MAX_PNG_WIDTH)
+    {
+      fitLogo(target, pngDecoder->getWidth(), pngDecoder->getHeight());
+      ok = pngDecoder->decode(nullptr, 0) == PNG_SUCCESS;
+    }
+    pngDecoder->close();
+    return ok;
+  }
+  return false; // ICO, SVG, WebP and friends are not worth a decoder here
+}
+#else
+bool decodeLogo(uint8_t *data, size_t len, uint16_t *target)
+{
+  return false;
+}
+#endif
+
+size_t fetchLogo(const char *url, uint8_t *dest, size_t size)
+{
+  WiFiClient plain;
+  WiFiClientSecure secure;
+  secure.setInsecure();
+  HTTPClient http;
+  http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
+  http.setTimeout(LOGO_FETCH_TIMEOUT_MS);
+  if (!(strncmp(url, "https:", 6) == 0 ? http.begin(secure, url) : http.begin(plain, url)))
+    return 0;
+
+  size_t total = 0;
+  if (http.GET() == HTTP_CODE_OK)
+  {
+    int expected = http.getSize();
+    WiFiClient *stream = http.getStreamPtr();
+    uint32_t start = millis();
+    while (total < size && (expected < 0 || total < (size_t)expected) && millis() - start < LOGO_FETCH_TIMEOUT_MS)
+    {
+      size_t available = stream->available();
+      if (available == 0)
+      {
+        if (!http.connected())
+          break;
+        vTaskDelay(pdMS_TO_TICKS(5));
+        continue;
+      }
+      total += stream->readBytes(dest + total, min(available, size - total));
+    }
+    if (expected > 0 && total != (size_t)expected)
+      total = 0;
+  }
+  http.end();
+  return total;
+}
+
+void logoPath(char *dest, size_t size, uint32_t key)
+{
+  snprintf(dest, size, LOGO_DIR "/%08x.bmp", (unsigned)key);
+}
+
+bool loadLogoFile(LogoEntry *entry)
+{
+  char path[32];
+  logoPath(path, sizeof(path), entry->key);
+  File file = LittleFS.open(path, FILE_READ);
+  if (!file)
+    return false;
+  bool ok = file.size() == LOGO_BMP_SIZE && file.read(entry->bmp, LOGO_BMP_SIZE) == LOGO_BMP_SIZE;
+  file.close();
+  return ok;
+}
+
+// Keeps at most LOGO_FLASH_ENTRIES files, preferring those still cached in PSRAM
+void saveLogoFile(LogoEntry *entry)
+{
+  File dir = LittleFS.open(LOGO_DIR);
+  int count = 0;
+  char stale[40] = "";
+  for (File file = dir.openNextFile(); file; file = dir.openNextFile())
+  {
+    count++;
+    uint32_t key = strtoul(file.name(), nullptr, 16);
+    xSemaphoreTake(metadataLock, portMAX_DELAY);
+    bool cached = findLogo(key) != nullptr;
+    xSemaphoreGive(metadataLock);
+    if (!cached)
+      snprintf(stale, sizeof(stale), LOGO_DIR "/%s", file.name());
+    file.close();
+  }
+  dir.close();
+  if (count >= LOGO_FLASH_ENTRIES && stale[0])
+    LittleFS.remove(stale);
+  if (LittleFS.totalBytes() - LittleFS.usedBytes() < 2 * LOGO_BMP_SIZE)
+    return;
+
+  char path[32];
+  logoPath(path, sizeof(path), entry->key);
+  File file = LittleFS.open(path, FILE_WRITE);
+  if (file)
+  {
+    file.write(entry->bmp, LOGO_BMP_SIZE);
+    file.close();
+  }
+}
+
+void logoTask(void *param)
+{
+  uint8_t *download = (uint8_t *)ps_malloc(LOGO_MAX_BYTES);
+  LogoRequest request;
+  while (download)
+  {
+    if (xQueueReceive(logoQueue, &request, portMAX_DELAY) != pdTRUE)
+      continue;
+    uint32_t key = logoKey(request.url);
+    xSemaphoreTake(metadataLock, portMAX_DELAY);
+    LogoEntry *entry = findLogo(key) ? nullptr : allocateLogo(key);
+    xSemaphoreGive(metadataLock);
+    if (!entry)
+      continue;
+
+    if (loadLogoFile(entry))
+    {
+      entry->state = LOGO_READY;
+      continue;
+    }
+
+    logoFetches++;
+    uint32_t start = millis();
+    size_t len = fetchLogo(request.url, download, LOGO_MAX_BYTES);
+    writeBmpHeader(entry->bmp);
+    if (len && decodeLogo(download, len, logoPixels(entry)))
+    {
+      logoDecodeMsLast = millis() - start;
+      entry->state = LOGO_READY;
+      Serial.printf("logo        %s in %u ms\n", request.url, (unsigned)logoDecodeMsLast);
+      saveLogoFile(entry);
+    }
+    else
+    {
+      logoFailures++;
+      entry->state = LOGO_FAILED;
+      Serial.printf("logo        cannot use %s\n", request.url);
+    }
+  }
+  log_e("No PSRAM for logo downloads");
+  vTaskDelete(NULL);
+}
+
+void setupMetadata()
+{
+  metadataLock = xSemaphoreCreateMutex();
+  history = (HistoryEntry *)ps_calloc(HISTORY_SIZE, sizeof(HistoryEntry));
+  if constexpr (featureLogos)
+    logoCache = (LogoEntry *)ps_calloc(LOGO_CACHE_ENTRIES, sizeof(LogoEntry));
+  if (logoCache)
+  {
+    LittleFS.mkdir(LOGO_DIR);
+    logoQueue = xQueueCreate(LOGO_QUEUE_LENGTH, sizeof(LogoRequest));
+    xTaskCreatePinnedToCore(logoTask, "logo", 8192, NULL, 1, NULL, 0);
+  }
+  registerMetric("logo_fetches", &logoFetches);
+  registerMetric("logo_failures", &logoFailures);
+  registerMetric("logo_decode_ms_last", &logoDecodeMsLast);
+}
+
+// Picks the logo when a new stream starts: the one given with /play, else
+// the server's icy-logo
+void metadataLoop()
+{
+  static uint32_t lastGeneration = 0;
+  if (tapGeneration == lastGeneration || !tapRunning)
+    return;
+  lastGeneration = tapGeneration;
+
+  char url[sizeof(pendingLogoURL)];
+  portENTER_CRITICAL(&logoMux);
+  strlcpy(url, pendingLogoURL, sizeof(url));
+  pendingLogoURL[0] = '\0';
+  portEXIT_CRITICAL(&logoMux);
+  if (!url[0])
+    strlcpy(url, tapLogoURL, sizeof(url));
+  requestLogo(url);
+}
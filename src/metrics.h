@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+
+#define MAX_METRICS 64
+
+// Counters and gauges exported on /metrics, one "name value" line each.
+// Modules own their values and register a pointer once at setup.
+struct Metric
+{
+  const char *name;
+  const volatile uint32_t *value;
+};
+
+Metric metrics[MAX_METRICS];
+int metricCount = 0;
+
+volatile uint32_t heapFree = 0;
+volatile uint32_t heapMinFree = 0;
+volatile uint32_t heapLargestBlock = 0;
+volatile uint32_t psramFree = 0;
+
+void updateSystemMetrics()
+{
+  heapFree = ESP.getFreeHeap();
+  heapMinFree = ESP.getMinFreeHeap();
+  heapLargestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  psramFree = ESP.getFreePsram();
+}
+
+void registerMetric(const char *name, const volatile uint32_t *value)
+{
+  if (metricCount >= MAX_METRICS)
+  {
+    log_e("Too many metrics, dropping %s", name);
+    return;
+  }
+  metrics[metricCount].name = name;
+  metrics[metricCount].value = value;
+  metricCount++;
+}
+
+size_t formatMetrics(char *dest, size_t destSize)
+{
+  size_t len = 0;
+  dest[0] = '\0';
+  for (int i = 0; i < metricCount && len < destSize; i++)
+  {
+    int n = snprintf(dest + len, destSize - len, "%s %u\n", metrics[i].name, (unsigned)*metrics[i].value);
+    if (n < 0)
+      break;
+    len += n;
+  }
+  return len < destSize ? len : destSize - 1;
+}
+
+void registerSystemMetrics()
+{
+  registerMetric("heap_free", &heapFree);
+  registerMetric("heap_min_free", &heapMinFree);
+  registerMetric("heap_largest_block", &heapLargestBlock);
+  registerMetric("psram_free", &psramFree);
+}
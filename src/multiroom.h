@@ -0,0 +1,462 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <EEPROM.h>
+#include <esp_timer.h>
+#include "Audio.h"
+#include "epromAddreses.h"
+#include "metrics.h"
+#include "streamtap.h"
+#include "multiroom_proto.h"
+#include "utf8text.h"
+
+// Leader/follower playback. The leader multicasts the tap ring plus
+// periodic "my decoder is at offset X at time T" beacons; followers fill
+// their own ring from the multicast, estimate the leader clock and steer
+// their decoder position onto the leader's.
+
+#define MULTIROOM_BEACON_MS 250
+#define MULTIROOM_ANNOUNCE_MS 1000
+#define MULTIROOM_SYNC_MS 2000
+#define MULTIROOM_TOLERANCE_MS 5 // floor; the tolerance is never below one decoded chunk
+#define MULTIROOM_SETTLE_MS 2000
+#define MULTIROOM_START_LEAD_MS 300 // time audio takes from connect to first sample
+#define I2S_DMA_MS 190              // what the I2S DMA ring holds; a stall shorter than this is inaudible
+
+extern Audio audio;
+extern char stationTitle[256];
+
+enum MultiroomRole : uint8_t
+{
+  MULTIROOM_OFF = 0,
+  MULTIROOM_LEADER = 1,
+  MULTIROOM_FOLLOWER = 2,
+};
+
+volatile uint32_t multiroomRole = MULTIROOM_OFF;
+volatile int32_t pendingMultiroomRole = -1; // set by /multiroom, applied by multiroomLoop()
+WiFiUDP multiroomData;
+WiFiUDP multiroomSyncSocket;
+IPAddress multiroomGroup(MULTIROOM_GROUP_IP);
+
+// Follower state. The clock estimate and the leader position are written by
+// multiroomTask on core 0 and read by multiroomLoop() on core 1, so both go
+// through multiroomMux.
+portMUX_TYPE multiroomMux = portMUX_INITIALIZER_UNLOCKED;
+ClockEstimator multiroomClock;
+MultiroomAnnounce leaderAnnounce;
+IPAddress leaderIP;
+volatile uint32_t leaderGeneration = 0;
+volatile bool leaderAnnounced = false;
+volatile bool followerStreaming = false; // ring is being filled
+volatile bool followerPlaying = false;   // audio plays from the relay
+volatile bool followerRestart = false;
+uint32_t leaderPosition = 0;
+int64_t leaderPositionUs = 0;
+volatile bool leaderPositionValid = false;
+
+volatile uint32_t stallUntilMillis = 0;
+volatile int32_t dropRemainingMs = 0;
+int32_t multiroomChunkMs = 0; // length of the last decoded chunk
+uint32_t settleUntilMillis = 0;
+int32_t multiroomErrorAvgMs = 0;
+int multiroomErrorSamples = 0;
+
+volatile uint32_t multiroomErrorAbsMs = 0;
+volatile uint32_t multiroomRttUs = 0;
+volatile uint32_t multiroomSlips = 0;
+volatile uint32_t multiroomPacketsSent = 0;
+volatile uint32_t multiroomPacketsReceived = 0;
+
+int64_t multiroomNowUs()
+{
+  return esp_timer_get_time();
+}
+
+// Stream offset the decoder is working on: what audio was handed minus what
+// is still sitting in its input buffer
+uint32_t playedOffset()
+{
+  return relayCursor - audio.inBufferFilled();
+}
+
+void sendMultiroomPacket(WiFiUDP &udp, IPAddress ip, uint16_t port, MultiroomPacketType type,
+                         uint32_t offset, const void *payload, uint16_t length)
+{
+  static uint8_t packet[sizeof(MultiroomHeader) + MULTIROOM_MAX_PAYLOAD];
+  MultiroomHeader &header = *(MultiroomHeader *)packet;
+  multiroomHeader(header, type, length, tapGeneration, offset, multiroomNowUs());
+  memcpy(packet + sizeof(MultiroomHeader), payload, length);
+  udp.beginPacket(ip, port);
+  udp.write(packet, sizeof(MultiroomHeader) + length);
+  udp.endPacket();
+  multiroomPacketsSent++;
+}
+
+void sendAnnounce()
+{
+  MultiroomAnnounce announce = {};
+  announce.bitrate = tapByteRate() * 8;
+  strlcpy(announce.contentType, tapContentType, sizeof(announce.contentType));
+  utf8Copy(announce.stationName, sizeof(announce.stationName), tapStationName);
+  utf8Copy(announce.streamTitle, sizeof(announce.streamTitle), stationTitle);
+  sendMultiroomPacket(multiroomData, multiroomGroup, MULTIROOM_DATA_PORT, MULTIROOM_ANNOUNCE, tapHead, &announce, sizeof(announce));
+}
+
+void leaderStep(uint32_t &cursor, uint32_t &generation, uint32_t &lastBeacon, uint32_t &lastAnnounce)
+{
+  static uint8_t payload[MULTIROOM_MAX_PAYLOAD];
+
+  // Answer clock probes first, they are time critical
+  int size = multiroomSyncSocket.parsePacket();
+  if (size > 0)
+  {
+    int64_t t2 = multiroomNowUs();
+    uint8_t packet[sizeof(MultiroomHeader) + sizeof(MultiroomSync)];
+    int n = multiroomSyncSocket.read(packet, sizeof(packet));
+    const MultiroomHeader *header = multiroomParse(packet, n);
+    if (header && header->type == MULTIROOM_SYNC_REQUEST && header->length == sizeof(MultiroomSync))
+    {
+      MultiroomSync sync;
+      memcpy(&sync, packet + sizeof(MultiroomHeader), sizeof(sync));
+      sync.t2 = t2;
+      sync.t3 = multiroomNowUs();
+      sendMultiroomPacket(multiroomSyncSocket, multiroomSyncSocket.remoteIP(), multiroomSyncSocket.remotePort(),
+                          MULTIROOM_SYNC_RESPONSE, 0, &sync, sizeof(sync));
+    }
+  }
+
+  if (!tapActive())
+  {
+    vTaskDelay(pdMS_TO_TICKS(20));
+    return;
+  }
+  if (generation != tapGeneration)
+  {
+    generation = tapGeneration;
+    cursor = tapHead;
+    lastAnnounce = 0;
+  }
+
+  if (millis() - lastAnnounce >= MULTIROOM_ANNOUNCE_MS)
+  {
+    sendAnnounce();
+    lastAnnounce = millis();
+  }
+  if (millis() - lastBeacon >= MULTIROOM_BEACON_MS)
+  {
+    sendMultiroomPacket(multiroomData, multiroomGroup, MULTIROOM_DATA_PORT, MULTIROOM_POSITION, playedOffset(), nullptr, 0);
+    lastBeacon = millis();
+  }
+
+  int n = tapReadRing(cursor, payload, sizeof(payload));
+  if (n < 0)
+  {
+    cursor = tapOldestOffset();
+    return;
+  }
+  if (n == 0)
+  {
+    vTaskDelay(pdMS_TO_TICKS(5));
+    return;
+  }
+  sendMultiroomPacket(multiroomData, multiroomGroup, MULTIROOM_DATA_PORT, MULTIROOM_DATA, cursor, payload, n);
+  cursor += n;
+}
+
+void followerStep(uint32_t &lastSync)
+{
+  static uint8_t packet[sizeof(MultiroomHeader) + MULTIROOM_MAX_PAYLOAD];
+
+  int size;
+  while ((size = multiroomData.parsePacket()) > 0)
+  {
+    int n = multiroomData.read(packet, sizeof(packet));
+    const MultiroomHeader *header = multiroomParse(packet, n);
+    if (!header)
+      continue;
+    multiroomPacketsReceived++;
+    const uint8_t *payload = packet + sizeof(MultiroomHeader);
+
+    if (header->type == MULTIROOM_ANNOUNCE && header->length == sizeof(MultiroomAnnounce))
+    {
+      leaderIP = multiroomData.remoteIP();
+      memcpy(&leaderAnnounce, payload, sizeof(leaderAnnounce));
+      if (!leaderAnnounced || header->generation != leaderGeneration)
+      {
+        // New station on the leader: drop our ring and start again
+        followerStreaming = false;
+        followerRestart = true;
+        leaderPositionValid = false;
+        leaderGeneration = header->generation;
+        leaderAnnounced = true;
+      }
+      else if (followerStreaming)
+      {
+        portENTER_CRITICAL(&tapTitleMux);
+        if (strncmp(leaderAnnounce.streamTitle, tapPendingTitle, sizeof(leaderAnnounce.streamTitle)) != 0)
+        {
+          strlcpy(tapPendingTitle, leaderAnnounce.streamTitle, sizeof(tapPendingTitle));
+          tapPendingTitleOffset = relayCursor;
+          tapTitlePending = true;
+        }
+        portEXIT_CRITICAL(&tapTitleMux);
+      }
+    }
+    else if (header->generation != leaderGeneration || !leaderAnnounced || followerRestart)
+      continue;
+    else if (header->type == MULTIROOM_DATA)
+    {
+      if (!followerStreaming)
+      {
+        tapStartExternal(header->offset, leaderAnnounce.contentType, leaderAnnounce.stationName, leaderAnnounce.bitrate);
+        followerStreaming = true;
+      }
+      tapWriteAt(header->offset, payload, header->length);
+    }
+    else if (header->type == MULTIROOM_POSITION)
+    {
+      portENTER_CRITICAL(&multiroomMux);
+      leaderPosition = header->offset;
+      leaderPositionUs = header->leaderTimeUs;
+      portEXIT_CRITICAL(&multiroomMux);
+      leaderPositionValid = true;
+    }
+  }
+
+  size = multiroomSyncSocket.parsePacket();
+  if (size > 0)
+  {
+    int64_t t4 = multiroomNowUs();
+    int n = multiroomSyncSocket.read(packet, sizeof(packet));
+    const MultiroomHeader *header = multiroomParse(packet, n);
+    if (header && header->type == MULTIROOM_SYNC_RESPONSE && header->length == sizeof(MultiroomSync))
+    {
+      MultiroomSync sync;
+      memcpy(&sync, packet + sizeof(MultiroomHeader), sizeof(sync));
+      portENTER_CRITICAL(&multiroomMux);
+      multiroomClock.addSample(sync.t1, sync.t2, sync.t3, t4);
+      multiroomRttUs = multiroomClock.rtt();
+      portEXIT_CRITICAL(&multiroomMux);
+    }
+  }
+
+  if (leaderAnnounced && millis() - lastSync >= MULTIROOM_SYNC_MS)
+  {
+    MultiroomSync sync = {};
+    sync.t1 = multiroomNowUs();
+    sendMultiroomPacket(multiroomSyncSocket, leaderIP, MULTIROOM_SYNC_PORT, MULTIROOM_SYNC_REQUEST, 0, &sync, sizeof(sync));
+    lastSync = millis();
+  }
+
+  vTaskDelay(pdMS_TO_TICKS(2));
+}
+
+void multiroomTask(void *param)
+{
+  uint32_t role = MULTIROOM_OFF;
+  uint32_t cursor = 0, generation = 0, lastBeacon = 0, lastAnnounce = 0, lastSync = 0;
+
+  for (;;)
+  {
+    if (role != multiroomRole)
+    {
+      multiroomData.stop();
+      multiroomSyncSocket.stop();
+      role = multiroomRole;
+      leaderAnnounced = false;
+      followerStreaming = false;
+      portENTER_CRITICAL(&multiroomMux);
+      multiroomClock = ClockEstimator();
+      portEXIT_CRITICAL(&multiroomMux);
+      if (role == MULTIROOM_LEADER)
+      {
+        multiroomData.begin(MULTIROOM_DATA_PORT);
+        multiroomSyncSocket.begin(MULTIROOM_SYNC_PORT);
+        generation = tapGeneration - 1; // announce right away
+      }
+      else if (role == MULTIROOM_FOLLOWER)
+      {
+        multiroomData.beginMulticast(multiroomGroup, MULTIROOM_DATA_PORT);
+        multiroomSyncSocket.begin(MULTIROOM_SYNC_PORT);
+      }
+    }
+
+    if (role == MULTIROOM_LEADER)
+      leaderStep(cursor, generation, lastBeacon, lastAnnounce);
+    else if (role == MULTIROOM_FOLLOWER)
+      followerStep(lastSync);
+    else
+      vTaskDelay(pdMS_TO_TICKS(100));
+  }
+}
+
+void setupMultiroom()
+{
+  if (!tapRing)
+    return;
+  uint8_t role = EEPROM.readByte(MULTIROOM_ROLE_EPROM_ADDRESS);
+  multiroomRole = role <= MULTIROOM_FOLLOWER ? role : MULTIROOM_OFF;
+  xTaskCreatePinnedToCore(multiroomTask, "multiroom", 4096, NULL, 4, NULL, 0);
+
+  registerMetric("multiroom_role", &multiroomRole);
+  registerMetric("multiroom_error_abs_ms", &multiroomErrorAbsMs);
+  registerMetric("multiroom_rtt_us", &multiroomRttUs);
+  registerMetric("multiroom_slips", &multiroomSlips);
+  registerMetric("multiroom_packets_sent", &multiroomPacketsSent);
+  registerMetric("multiroom_packets_received", &multiroomPacketsReceived);
+}
+
+// Safe from the web server task; the switch itself stops the stream and
+// writes flash, so multiroomLoop() does it on the main task
+bool setMultiroomRole(uint32_t role)
+{
+  if (role > MULTIROOM_FOLLOWER || (role != MULTIROOM_OFF && !tapRing))
+    return false;
+  pendingMultiroomRole = role;
+  return true;
+}
+
+void applyMultiroomRole(uint32_t role)
+{
+  if (multiroomRole == MULTIROOM_FOLLOWER || role == MULTIROOM_FOLLOWER)
+  {
+    stopStream();
+    followerPlaying = false;
+  }
+  multiroomRole = role;
+  EEPROM.writeByte(MULTIROOM_ROLE_EPROM_ADDRESS, role);
+  EEPROM.commit();
+  Serial.printf("multiroom   role %u\n", (unsigned)role);
+}
+
+// The follower skips audio.loop() while this is true
+bool multiroomFollowing()
+{
+  return multiroomRole == MULTIROOM_FOLLOWER;
+}
+
+bool multiroomHoldAudio()
+{
+  return (int32_t)(stallUntilMillis - millis()) > 0;
+}
+
+// From audio_process_i2s(): drops whole decoded chunks while the follower
+// is behind. Chunks are what the decoder hands over, so this is the finest
+// slip available without touching the I2S driver. A chunk is only dropped
+// while at least that much is left to drop, so a correction stops short
+// rather than overshooting into a stall.
+void multiroomProcessI2S(int32_t validSamples, bool *continueI2S)
+{
+  *continueI2S = true;
+  uint32_t sampleRate = audio.getSampleRate();
+  if (sampleRate == 0)
+    return;
+  int32_t chunkMs = validSamples * 1000 / (int32_t)sampleRate;
+  multiroomChunkMs = chunkMs;
+  if (dropRemainingMs <= 0 || chunkMs <= 0)
+    return;
+  if (dropRemainingMs < chunkMs)
+  {
+    dropRemainingMs = 0;
+    return;
+  }
+  dropRemainingMs -= chunkMs;
+  *continueI2S = false;
+}
+
+// Drops come in whole chunks (23-26 ms for MP3 and AAC), so an error below
+// one chunk cannot be corrected without overshooting
+int32_t multiroomToleranceMs()
+{
+  return max((int32_t)MULTIROOM_TOLERANCE_MS, multiroomChunkMs);
+}
+
+// Follower control loop, runs on the main task
+void multiroomLoop()
+{
+  int32_t newRole = pendingMultiroomRole;
+  if (newRole >= 0)
+  {
+    pendingMultiroomRole = -1;
+    applyMultiroomRole(newRole);
+  }
+  if (multiroomRole != MULTIROOM_FOLLOWER)
+    return;
+
+  if (followerRestart)
+  {
+    if (followerPlaying)
+      audio.stopSong();
+    followerPlaying = false;
+    tapStop();
+    followerRestart = false;
+  }
+
+  if (!followerStreaming || !leaderPositionValid)
+    return;
+  portENTER_CRITICAL(&multiroomMux);
+  bool clockValid = multiroomClock.valid();
+  int64_t clockOffset = multiroomClock.offset();
+  uint32_t position = leaderPosition;
+  int64_t positionUs = leaderPositionUs;
+  portEXIT_CRITICAL(&multiroomMux);
+  if (!clockValid)
+    return;
+
+  uint32_t byteRate = tapByteRate();
+  int64_t leaderNowUs = multiroomNowUs() + clockOffset;
+
+  if (!followerPlaying)
+  {
+    // Join where the leader will be once audio is up and running
+    int32_t startAheadMs = -multiroomErrorMs(tapOldestOffset(), position, positionUs, leaderNowUs, byteRate);
+    if (startAheadMs < MULTIROOM_START_LEAD_MS)
+      return; // our ring does not reach back that far yet
+    uint32_t target = tapOldestOffset() + (uint32_t)((int64_t)(startAheadMs + MULTIROOM_START_LEAD_MS) * byteRate / 1000);
+    if ((int32_t)(tapHead - target) < 0)
+      return;
+    char relay[64];
+    relayURL(relay, sizeof(relay), target);
+    followerPlaying = audio.connecttohost(relay);
+    settleUntilMillis = millis() + MULTIROOM_SETTLE_MS;
+    multiroomErrorSamples = 0;
+    return;
+  }
+
+  static uint32_t lastCheck = 0;
+  if (millis() - lastCheck < MULTIROOM_BEACON_MS || (int32_t)(settleUntilMillis - millis()) > 0)
+    return;
+  lastCheck = millis();
+
+  // The decoder consumes whole frames, so single readings jitter by a frame;
+  // steer on the average
+  int32_t error = multiroomErrorMs(playedOffset(), position, positionUs, leaderNowUs, byteRate);
+  if (multiroomErrorSamples == 0)
+    multiroomErrorAvgMs = error;
+  else
+    multiroomErrorAvgMs = (multiroomErrorAvgMs * 7 + error) / 8;
+  multiroomErrorAbsMs = abs(multiroomErrorAvgMs);
+  if (++multiroomErrorSamples < 8)
+    return;
+
+  int32_t tolerance = multiroomToleranceMs();
+  if (multiroomErrorAvgMs > tolerance)
+  {
+    // Ahead: starve I2S long enough to play that much silence
+    stallUntilMillis = millis() + I2S_DMA_MS + multiroomErrorAvgMs;
+    multiroomSlips++;
+    settleUntilMillis = millis() + I2S_DMA_MS + multiroomErrorAvgMs + MULTIROOM_SETTLE_MS;
+    multiroomErrorSamples = 0;
+  }
+  else if (multiroomErrorAvgMs < -tolerance)
+  {
+    // Behind: skip decoded audio
+    dropRemainingMs = -multiroomErrorAvgMs;
+    multiroomSlips++;
+    settleUntilMillis = millis() + MULTIROOM_SETTLE_MS;
+    multiroomErrorSamples = 0;
+  }
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Wire format and clock maths for multi-room playback. Kept free of
+// Arduino headers so two host builds can talk to each other over loopback.
+
+#define MULTIROOM_MAGIC 0x524D5241 // "ARMR"
+#define MULTIROOM_VERSION 1
+#define MULTIROOM_GROUP_IP 239, 255, 42, 99
+#define MULTIROOM_DATA_PORT 5004
+#define MULTIROOM_SYNC_PORT 5005
+#define MULTIROOM_MAX_PAYLOAD 1200
+#define MULTIROOM_CLOCK_SAMPLES 8
+
+enum MultiroomPacketType : uint8_t
+{
+  MULTIROOM_DATA = 1,     // offset = stream offset of payload[0]
+  MULTIROOM_POSITION = 2, // offset = stream offset the leader's decoder is at
+  MULTIROOM_ANNOUNCE = 3, // payload = MultiroomAnnounce
+  MULTIROOM_SYNC_REQUEST = 4,
+  MULTIROOM_SYNC_RESPONSE = 5, // payload = MultiroomSync
+};
+
+struct __attribute__((packed)) MultiroomHeader
+{
+  uint32_t magic;
+  uint8_t version;
+  uint8_t type;
+  uint16_t length; // payload bytes after the header
+  uint32_t generation; // bumped by the leader on every station change
+  uint32_t offset;
+  int64_t leaderTimeUs;
+};
+
+struct __attribute__((packed)) MultiroomAnnounce
+{
+  uint32_t bitrate; // bits per second
+  char contentType[64];
+  char stationName[128];
+  char streamTitle[128];
+};
+
+struct __attribute__((packed)) MultiroomSync
+{
+  int64_t t1; // follower send
+  int64_t t2; // leader receive
+  int64_t t3; // leader send
+};
+
+inline void multiroomHeader(MultiroomHeader &header, MultiroomPacketType type, uint16_t length,
+                            uint32_t generation, uint32_t offset, int64_t leaderTimeUs)
+{
+  header.magic = MULTIROOM_MAGIC;
+  header.version = MULTIROOM_VERSION;
+  header.type = type;
+  header.length = length;
+  header.generation = generation;
+  header.offset = offset;
+  header.leaderTimeUs = leaderTimeUs;
+}
+
+// Returns the header if `packet` is a well-formed packet of ours
+inline const MultiroomHeader *multiroomParse(const uint8_t *packet, size_t size)
+{
+  if (size < sizeof(MultiroomHeader))
+    return nullptr;
+  const MultiroomHeader *header = (const MultiroomHeader *)packet;
+  if (header->magic != MULTIROOM_MAGIC || header->version != MULTIROOM_VERSION)
+    return nullptr;
+  if (sizeof(MultiroomHeader) + header->length > size)
+    return nullptr;
+  return header;
+}
+
+// NTP-style offset estimate. Of the last few exchanges only the one with
+// the shortest round trip is trusted: its queueing delay is the smallest,
+// so it is the least asymmetric.
+struct ClockEstimator
+{
+  int64_t offsets[MULTIROOM_CLOCK_SAMPLES];
+  int64_t rtts[MULTIROOM_CLOCK_SAMPLES];
+  int count = 0;
+  int next = 0;
+
+  void addSample(int64_t t1, int64_t t2, int64_t t3, int64_t t4)
+  {
+    offsets[next] = ((t2 - t1) + (t3 - t4)) / 2;
+    rtts[next] = (t4 - t1) - (t3 - t2);
+    next = (next + 1) % MULTIROOM_CLOCK_SAMPLES;
+    if (count < MULTIROOM_CLOCK_SAMPLES)
+      count++;
+  }
+
+  bool valid() const { return count > 0; }
+
+  int best() const
+  {
+    int best = 0;
+    for (int i = 1; i < count; i++)
+      if (rtts[i] < rtts[best])
+        best = i;
+    return best;
+  }
+
+  // leader clock = local clock + offset()
+  int64_t offset() const { return count ? offsets[best()] : 0; }
+  int64_t rtt() const { return count ? rtts[best()] : 0; }
+};
+
+// How far ahead of the leader (positive) or behind it (negative) a follower
+// plays, in milliseconds. The leader was at `leaderOffset` at leader time
+// `leaderTimeUs` and moves at `byteRate`.
+inline int32_t multiroomErrorMs(uint32_t followerOffset, uint32_t leaderOffset, int64_t leaderTimeUs,
+                                int64_t leaderNowUs, uint32_t byteRate)
+{
+  if (byteRate == 0)
+    return 0;
+  int64_t leaderNow = (int64_t)leaderOffset + (leaderNowUs - leaderTimeUs) * (int64_t)byteRate / 1000000;
+  int64_t aheadBytes = (int64_t)(int32_t)(followerOffset - (uint32_t)leaderNow);
+  return (int32_t)(aheadBytes * 1000 / byteRate);
+}
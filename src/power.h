@@ -0,0 +1,147 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_wifi.h>
+#include <esp_pm.h>
+#include "Audio.h"
+#include "metrics.h"
+#include "streamtap.h"
+
+#define IDLE_TIMEOUT_MS 15000
+#define IDLE_LOOP_DELAY_MS 20
+#define ACTIVE_CPU_MHZ 240
+#define IDLE_CPU_MHZ 80
+
+extern Audio audio;
+
+void displaySleep(bool sleep);
+
+enum PowerState
+{
+  POWER_ACTIVE,
+  POWER_IDLE
+};
+
+volatile PowerState powerState = POWER_ACTIVE;
+volatile uint32_t lastActivityMillis = 0;
+volatile uint32_t wakeRequestMillis = 0;
+volatile bool wakeRequested = false;
+
+volatile uint32_t powerIsIdle = 0;
+volatile uint32_t powerIdleEntries = 0;
+volatile uint32_t powerIdleMs = 0;
+volatile uint32_t powerWakeLatencyMs = 0;
+volatile uint32_t powerCpuMhz = ACTIVE_CPU_MHZ;
+
+uint32_t idleSinceMillis = 0;
+uint32_t idleMsBefore = 0;
+
+#if CONFIG_PM_ENABLE
+esp_pm_lock_handle_t cpuMaxLock = nullptr;
+#endif
+
+// Let dynamic frequency scaling drop the CPU clock. With IDF power
+// management we just release the max-frequency lock, so waking is a lock
+// acquire that is safe from any task.
+void setCpuIdle(bool idle)
+{
+#if CONFIG_PM_ENABLE
+  if (idle)
+    esp_pm_lock_release(cpuMaxLock);
+  else
+    esp_pm_lock_acquire(cpuMaxLock);
+#else
+  setCpuFrequencyMhz(idle ? IDLE_CPU_MHZ : ACTIVE_CPU_MHZ);
+#endif
+  powerCpuMhz = idle ? IDLE_CPU_MHZ : ACTIVE_CPU_MHZ;
+}
+
+void setupPower()
+{
+#if CONFIG_PM_ENABLE
+  esp_pm_config_t pmConfig = {
+      .max_freq_mhz = ACTIVE_CPU_MHZ,
+      .min_freq_mhz = IDLE_CPU_MHZ,
+      .light_sleep_enable = false,
+  };
+  if (esp_pm_configure(&pmConfig) != ESP_OK ||
+      esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "aradio", &cpuMaxLock) != ESP_OK)
+    log_e("Power management not available");
+  else
+    esp_pm_lock_acquire(cpuMaxLock);
+#endif
+  // Streaming needs the radio fully awake, modem sleep is for idle only
+  esp_wifi_set_ps(WIFI_PS_NONE);
+  lastActivityMillis = millis();
+
+  registerMetric("power_idle", &powerIsIdle);
+  registerMetric("power_idle_entries", &powerIdleEntries);
+  registerMetric("power_idle_ms", &powerIdleMs);
+  registerMetric("power_wake_latency_ms", &powerWakeLatencyMs);
+  registerMetric("power_cpu_mhz", &powerCpuMhz);
+}
+
+// Safe to call from the web server task: raises the clock right away and
+// leaves the rest of the wake-up to powerLoop().
+void powerWake()
+{
+  lastActivityMillis = millis();
+  if (powerState == POWER_IDLE && !wakeRequested)
+  {
+    wakeRequestMillis = millis();
+    wakeRequested = true;
+#if CONFIG_PM_ENABLE
+    setCpuIdle(false);
+#endif
+  }
+}
+
+void enterIdle()
+{
+  Serial.println("Entering idle mode");
+  powerState = POWER_IDLE;
+  powerIsIdle = 1;
+  powerIdleEntries++;
+  idleSinceMillis = millis();
+  displaySleep(true);
+  esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+  setCpuIdle(true);
+}
+
+void leaveIdle()
+{
+#if !CONFIG_PM_ENABLE
+  setCpuIdle(false);
+#endif
+  esp_wifi_set_ps(WIFI_PS_NONE);
+  displaySleep(false);
+  idleMsBefore += millis() - idleSinceMillis;
+  powerIdleMs = idleMsBefore;
+  powerWakeLatencyMs = wakeRequested ? millis() - wakeRequestMillis : 0;
+  wakeRequested = false;
+  powerState = POWER_ACTIVE;
+  powerIsIdle = 0;
+  Serial.println("Leaving idle mode");
+}
+
+void powerLoop()
+{
+  // A paused timeshift still downloads, keep the radio and clock up for it
+  if (audio.isRunning() || tapActive())
+    lastActivityMillis = millis();
+
+  if (powerState == POWER_ACTIVE)
+  {
+    if (millis() - lastActivityMillis >= IDLE_TIMEOUT_MS)
+      enterIdle();
+  }
+  else if (wakeRequested || audio.isRunning() || tapActive())
+  {
+    leaveIdle();
+  }
+  else
+  {
+    powerIdleMs = idleMsBefore + (millis() - idleSinceMillis);
+  }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <Arduino.h>
+#include "metrics.h"
+
+// Per-client token buckets for the control routes. Buckets are kept in a
+// small table keyed by (client IP, route); the least recently used entry is
+// recycled when a new client shows up.
+
+#define RATE_LIMIT_BUCKETS 16
+
+struct RateLimit
+{
+  const char *path;
+  uint16_t burst;
+  uint16_t perSecond;
+};
+
+const RateLimit rateLimits[] = {
+    {"/play", 3, 1},
+    {"/stop", 3, 1},
+    {"/seek", 3, 1},
+    {"/record", 3, 1},
+    {"/recording", 3, 1},
+    {"/multiroom", 2, 1},
+    {"/alarm", 3, 1},
+    {"/sleep", 3, 1},
+    {"/timezone", 2, 1},
+    {"/pause", 5, 2},
+    {"/resume", 5, 2},
+    {"/setvolume", 10, 5},
+    {"/logo", 10, 2},
+};
+
+struct RateBucket
+{
+  uint32_t ip;
+  int8_t route; // index into rateLimits, -1 when free
+  uint32_t milliTokens;
+  uint32_t lastRefill;
+};
+
+// Only touched from the AsyncTCP task
+RateBucket rateBuckets[RATE_LIMIT_BUCKETS];
+
+volatile uint32_t rateLimited = 0;
+
+void setupRateLimit()
+{
+  for (int i = 0; i < RATE_LIMIT_BUCKETS; i++)
+    rateBuckets[i].route = -1;
+  registerMetric("http_rate_limited", &rateLimited);
+}
+
+int rateLimitRoute(const char *path)
+{
+  for (size_t i = 0; i < sizeof(rateLimits) / sizeof(rateLimits[0]); i++)
+    if (strcmp(path, rateLimits[i].path) == 0)
+      return i;
+  return -1;
+}
+
+bool rateLimitAllow(uint32_t ip, const char *path)
+{
+  int route = rateLimitRoute(path);
+  if (route < 0)
+    return true;
+  const RateLimit &limit = rateLimits[route];
+  uint32_t now = millis();
+
+  RateBucket *bucket = nullptr;
+  RateBucket *oldest = &rateBuckets[0];
+  for (int i = 0; i < RATE_LIMIT_BUCKETS; i++)
+  {
+    if (rateBuckets[i].route == route && rateBuckets[i].ip == ip)
+    {
+      bucket = &rateBuckets[i];
+      break;
+    }
+    if (rateBuckets[i].route < 0 || now - rateBuckets[i].lastRefill > now - oldest->lastRefill)
+      oldest = &rateBuckets[i];
+  }
+  if (!bucket)
+  {
+    bucket = oldest;
+    bucket->ip = ip;
+    bucket->route = route;
+    bucket->milliTokens = limit.burst * 1000;
+    bucket->lastRefill = now;
+  }
+
+  uint32_t refill = (now - bucket->lastRefill) * limit.perSecond;
+  bucket->milliTokens = min(bucket->milliTokens + refill, (uint32_t)limit.burst * 1000);
+  bucket->lastRefill = now;
+
+  if (bucket->milliTokens < 1000)
+  {
+    rateLimited++;
+    return false;
+  }
+  bucket->milliTokens -= 1000;
+  return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <stdarg.h>
+#include "metrics.h"
+#include "responseslots.h"
+
+// Fixed response bodies for the route handlers. A body is formatted into a
+// free slot and sent with a response that points at it instead of copying
+// it into a String; the slot goes back to the pool when the request is
+// destroyed. Keeps UI request bursts from fragmenting the heap the decoder
+// and TLS live on.
+
+ResponseSlot *acquireResponseSlot(AsyncWebServerRequest *request)
+{
+  ResponseSlot *slot = takeResponseSlot();
+  if (slot)
+    request->onDisconnect([slot]()
+                          { releaseResponseSlot(slot); });
+  return slot;
+}
+
+LargeResponseSlot *acquireLargeResponseSlot(AsyncWebServerRequest *request)
+{
+  LargeResponseSlot *slot = takeLargeResponseSlot();
+  if (slot)
+    request->onDisconnect([slot]()
+                          { releaseLargeResponseSlot(slot); });
+  return slot;
+}
+
+void setupResponsePool()
+{
+  DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
+  for (int i = 0; i < RESPONSE_LARGE_SLOTS; i++)
+    largeResponsePool[i].body = (char *)ps_malloc(RESPONSE_LARGE_SLOT_SIZE);
+  registerMetric("http_pool_in_use", &responsePoolInUse);
+  registerMetric("http_pool_misses", &responsePoolMisses);
+}
+
+void sendSlot(AsyncWebServerRequest *request, int code, const char *contentType, ResponseSlot *slot, size_t len)
+{
+  request->send(request->beginResponse(code, contentType, (const uint8_t *)slot->body, len));
+}
+
+void sendText(AsyncWebServerRequest *request, int code, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  ResponseSlot *slot = acquireResponseSlot(request);
+  if (slot)
+  {
+    size_t len = formatSlot(slot, format, args);
+    sendSlot(request, code, "text/plain", slot, len);
+  }
+  else
+  {
+    // Pool exhausted: fall back to a copying response rather than failing
+    char body[256];
+    vsnprintf(body, sizeof(body), format, args);
+    request->send(code, "text/plain", body);
+  }
+  va_end(args);
+}
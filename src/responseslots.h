@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Slot bookkeeping behind responsepool.h. Kept free of Arduino headers so
+// a host build can check that taking, filling and releasing slots never
+// allocates.
+
+#define RESPONSE_POOL_SLOTS 6
+#define RESPONSE_SLOT_SIZE 2048
+#define RESPONSE_LARGE_SLOTS 2 // in PSRAM, for /history
+#define RESPONSE_LARGE_SLOT_SIZE (10 * 1024)
+
+struct ResponseSlot
+{
+  bool used;
+  char body[RESPONSE_SLOT_SIZE];
+};
+
+struct LargeResponseSlot
+{
+  bool used;
+  char *body; // RESPONSE_LARGE_SLOT_SIZE bytes
+};
+
+// Only touched from the AsyncTCP task
+ResponseSlot responsePool[RESPONSE_POOL_SLOTS];
+LargeResponseSlot largeResponsePool[RESPONSE_LARGE_SLOTS];
+
+volatile uint32_t responsePoolInUse = 0;
+volatile uint32_t responsePoolMisses = 0;
+
+ResponseSlot *takeResponseSlot()
+{
+  for (int i = 0; i < RESPONSE_POOL_SLOTS; i++)
+  {
+    if (!responsePool[i].used)
+    {
+      responsePool[i].used = true;
+      responsePoolInUse++;
+      return &responsePool[i];
+    }
+  }
+  responsePoolMisses++;
+  return nullptr;
+}
+
+void releaseResponseSlot(ResponseSlot *slot)
+{
+  slot->used = false;
+  responsePoolInUse--;
+}
+
+LargeResponseSlot *takeLargeResponseSlot()
+{
+  for (int i = 0; i < RESPONSE_LARGE_SLOTS; i++)
+  {
+    if (!largeResponsePool[i].used && largeResponsePool[i].body)
+    {
+      largeResponsePool[i].used = true;
+      responsePoolInUse++;
+      return &largeResponsePool[i];
+    }
+  }
+  responsePoolMisses++;
+  return nullptr;
+}
+
+void releaseLargeResponseSlot(LargeResponseSlot *slot)
+{
+  slot->used = false;
+  responsePoolInUse--;
+}
+
+// Formats into the slot body; returns the length, cut to fit
+size_t formatSlot(ResponseSlot *slot, const char *format, va_list args)
+{
+  int len = vsnprintf(slot->body, sizeof(slot->body), format, args);
+  if (len < 0)
+    return 0;
+  return (size_t)len < sizeof(slot->body) ? len : sizeof(slot->body) - 1;
+}
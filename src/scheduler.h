@@ -0,0 +1,393 @@
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <time.h>
+#include <esp_sntp.h>
+#include "Audio.h"
+#include "epromAddreses.h"
+#include "metrics.h"
+#include "streamtap.h"
+#include "control.h"
+#include "power.h"
+#include "timerwheel.h"
+
+// Wake-up alarms and sleep timers. One FreeRTOS timer advances a timer
+// wheel every SCHEDULER_TICK_MS; expired entries are posted to a queue that
+// schedulerLoop() drains on the main task, where playback is safe to touch.
+// Web routes only edit `alarms` / request a sleep timer; persisting and
+// (re)arming happens in schedulerLoop() as well.
+
+#define SCHEDULER_TICK_MS 100
+#define SCHEDULER_QUEUE_LENGTH 8
+#define SCHEDULER_NTP_SERVER "pool.ntp.org"
+#define SCHEDULER_DEFAULT_TZ "CET-1CEST,M3.5.0,M10.5.0/3"
+#define MAX_ALARMS 4
+#define ALARM_PRECONNECT_S 5 // connect this early so sound starts on the minute
+#define ALARM_MAGIC 0xA1
+#define FADE_MAX_VOLUME 21
+
+enum ScheduleEvent : uint8_t
+{
+  EVENT_ALARM_PRECONNECT = 1, // arg = alarm index
+  EVENT_ALARM_START,          // arg = alarm index
+  EVENT_FADE_STEP,
+  EVENT_SLEEP,
+  EVENT_TIME_SYNCED,
+};
+
+struct Alarm
+{
+  uint8_t magic; // ALARM_MAGIC when the slot is in use
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t days; // bit 0 = Sunday ... bit 6 = Saturday, 0 = next occurrence only
+  uint8_t volume;
+  uint8_t reserved;
+  uint16_t fadeSeconds;
+  char url[120];
+};
+
+struct ScheduledEvent
+{
+  uint8_t type;
+  uint32_t arg;
+};
+
+Alarm alarms[MAX_ALARMS];
+volatile bool alarmsDirty = false;
+char schedulerTZ[64] = SCHEDULER_DEFAULT_TZ;
+volatile bool tzDirty = false;
+
+TimerWheel schedulerWheel;
+SemaphoreHandle_t schedulerLock = nullptr;
+QueueHandle_t schedulerQueue = nullptr;
+TimerHandle_t schedulerTimer = nullptr;
+TickType_t schedulerLastTick = 0;
+
+// Sleep timer requests from the web server: minutes, fade seconds; 0 cancels
+volatile int32_t pendingSleepMinutes = -1;
+volatile uint32_t pendingSleepFade = 0;
+uint32_t sleepFadeSeconds = 0;
+time_t sleepAt = 0;
+
+int fadeTarget = -1;
+int fadeRestoreVolume = -1; // volume to put back after a fade-out stop
+bool fadeStopAtEnd = false;
+uint32_t fadeStepMs = 0;
+
+volatile uint32_t schedulerTimersArmed = 0;
+volatile uint32_t schedulerEvents = 0;
+volatile uint32_t schedulerQueueDrops = 0;
+volatile uint32_t alarmsFired = 0;
+
+extern char stationName[];
+extern char stationTitle[];
+
+bool timeValid()
+{
+  return time(nullptr) > 1700000000; // anything before late 2023 is the epoch-based boot clock
+}
+
+void postScheduleEvent(uint8_t type, uint32_t arg)
+{
+  ScheduledEvent event = {type, arg};
+  if (xQueueSend(schedulerQueue, &event, 0) != pdTRUE)
+    schedulerQueueDrops++;
+}
+
+// Timer service task: catch the wheel up with the tick count, which also
+// covers callbacks that were late or skipped because the lock was busy
+void schedulerTick(TimerHandle_t timer)
+{
+  if (xSemaphoreTake(schedulerLock, 0) != pdTRUE)
+    return;
+  TickType_t nowTick = xTaskGetTickCount();
+  uint32_t ticks = (nowTick - schedulerLastTick) / pdMS_TO_TICKS(SCHEDULER_TICK_MS);
+  schedulerLastTick += ticks * pdMS_TO_TICKS(SCHEDULER_TICK_MS);
+  schedulerWheel.advance(ticks, [](uint8_t type, uint32_t arg)
+                         { postScheduleEvent(type, arg); });
+  schedulerTimersArmed = schedulerWheel.armedCount;
+  xSemaphoreGive(schedulerLock);
+}
+
+void onTimeSynced(struct timeval *tv)
+{
+  postScheduleEvent(EVENT_TIME_SYNCED, 0);
+}
+
+int scheduleIn(uint32_t ms, uint8_t type, uint32_t arg)
+{
+  xSemaphoreTake(schedulerLock, portMAX_DELAY);
+  int id = schedulerWheel.add((ms + SCHEDULER_TICK_MS - 1) / SCHEDULER_TICK_MS, type, arg);
+  schedulerTimersArmed = schedulerWheel.armedCount;
+  xSemaphoreGive(schedulerLock);
+  return id;
+}
+
+void unschedule(uint8_t type, int64_t arg = -1)
+{
+  xSemaphoreTake(schedulerLock, portMAX_DELAY);
+  schedulerWheel.cancelType(type, arg);
+  schedulerTimersArmed = schedulerWheel.armedCount;
+  xSemaphoreGive(schedulerLock);
+}
+
+void loadAlarms()
+{
+  EEPROM.get(ALARMS_EPROM_ADDRESS, alarms);
+  for (int i = 0; i < MAX_ALARMS; i++)
+    if (alarms[i].magic != ALARM_MAGIC)
+      memset(&alarms[i], 0, sizeof(Alarm));
+  EEPROM.readString(TIMEZONE_EPROM_ADDRESS, schedulerTZ, sizeof(schedulerTZ));
+  if (schedulerTZ[0] == '\0' || (uint8_t)schedulerTZ[0] == 0xFF)
+    strlcpy(schedulerTZ, SCHEDULER_DEFAULT_TZ, sizeof(schedulerTZ));
+}
+
+// Next time the alarm goes off, in local time as set by TZ; 0 if never
+time_t nextAlarmTime(const Alarm &alarm, time_t now)
+{
+  struct tm today;
+  localtime_r(&now, &today);
+  for (int day = 0; day <= 7; day++)
+  {
+    struct tm candidate = today;
+    candidate.tm_mday += day;
+    candidate.tm_hour = alarm.hour;
+    candidate.tm_min = alarm.minute;
+    candidate.tm_sec = 0;
+    candidate.tm_isdst = -1;
+    time_t at = mktime(&candidate);
+    if (at - ALARM_PRECONNECT_S <= now)
+      continue;
+    if (alarm.days == 0 || (alarm.days & (1 << candidate.tm_wday)))
+      return at;
+  }
+  return 0;
+}
+
+void armAlarm(int index)
+{
+  unschedule(EVENT_ALARM_PRECONNECT, index);
+  unschedule(EVENT_ALARM_START, index);
+  if (alarms[index].magic != ALARM_MAGIC || !timeValid())
+    return;
+  time_t now = time(nullptr);
+  time_t at = nextAlarmTime(alarms[index], now);
+  if (at == 0)
+    return;
+  scheduleIn((uint32_t)(at - ALARM_PRECONNECT_S - now) * 1000, EVENT_ALARM_PRECONNECT, index);
+}
+
+void armAllAlarms()
+{
+  for (int i = 0; i < MAX_ALARMS; i++)
+    armAlarm(i);
+}
+
+void startFade(int from, int to, uint32_t seconds, bool stopAtEnd)
+{
+  unschedule(EVENT_FADE_STEP);
+  from = constrain(from, 0, FADE_MAX_VOLUME);
+  to = constrain(to, 0, FADE_MAX_VOLUME);
+  audio.setVolume(from);
+  fadeTarget = to;
+  fadeStopAtEnd = stopAtEnd;
+  int steps = abs(to - from);
+  if (steps == 0)
+  {
+    postScheduleEvent(EVENT_FADE_STEP, 0);
+    return;
+  }
+  fadeStepMs = seconds * 1000 / steps;
+  scheduleIn(fadeStepMs, EVENT_FADE_STEP, 0);
+}
+
+void fadeStep()
+{
+  int volume = audio.getVolume();
+  if (volume != fadeTarget)
+  {
+    volume += fadeTarget > volume ? 1 : -1;
+    audio.setVolume(volume);
+  }
+  if (volume != fadeTarget)
+  {
+    scheduleIn(fadeStepMs, EVENT_FADE_STEP, 0);
+    return;
+  }
+
+  fadeTarget = -1;
+  if (fadeStopAtEnd)
+  {
+    fadeStopAtEnd = false;
+    stationName[0] = '\0';
+    stationTitle[0] = '\0';
+    cancelPendingPlay();
+    stopStream();
+    EEPROM.writeString(LAST_URL_EPROM_ADDEESS, "");
+    EEPROM.commit();
+    // Leave the next /play at the volume the user had before the fade
+    if (fadeRestoreVolume >= 0)
+      audio.setVolume(fadeRestoreVolume);
+    fadeRestoreVolume = -1;
+    Serial.println("sleep       stopped");
+  }
+}
+
+void handleScheduleEvent(const ScheduledEvent &event)
+{
+  schedulerEvents++;
+  switch (event.type)
+  {
+  case EVENT_ALARM_PRECONNECT:
+  {
+    const Alarm &alarm = alarms[event.arg];
+    if (alarm.magic != ALARM_MAGIC)
+      break;
+    Serial.printf("alarm       %d connecting %s\n", (int)event.arg, alarm.url);
+    powerWake();
+    cancelPendingPlay();
+    // Silent until the minute, the decoder is already running by then
+    audio.setVolume(0);
+    unschedule(EVENT_FADE_STEP);
+    if (connectStream(alarm.url))
+    {
+      EEPROM.writeString(LAST_URL_EPROM_ADDEESS, alarm.url);
+      EEPROM.commit();
+    }
+    scheduleIn(ALARM_PRECONNECT_S * 1000, EVENT_ALARM_START, event.arg);
+    break;
+  }
+  case EVENT_ALARM_START:
+  {
+    const Alarm &alarm = alarms[event.arg];
+    alarmsFired++;
+    Serial.printf("alarm       %d on\n", (int)event.arg);
+    startFade(0, alarm.volume, alarm.fadeSeconds, false);
+    if (alarm.days == 0)
+    {
+      alarms[event.arg].magic = 0;
+      alarmsDirty = true;
+    }
+    else
+      armAlarm(event.arg);
+    break;
+  }
+  case EVENT_FADE_STEP:
+    fadeStep();
+    break;
+  case EVENT_SLEEP:
+    Serial.println("sleep       fading out");
+    fadeRestoreVolume = audio.getVolume();
+    startFade(fadeRestoreVolume, 0, sleepFadeSeconds, true);
+    sleepAt = 0;
+    break;
+  case EVENT_TIME_SYNCED:
+    Serial.println("time        synced");
+    armAllAlarms();
+    break;
+  }
+}
+
+void setupScheduler()
+{
+  loadAlarms();
+  schedulerLock = xSemaphoreCreateMutex();
+  schedulerQueue = xQueueCreate(SCHEDULER_QUEUE_LENGTH, sizeof(ScheduledEvent));
+  schedulerLastTick = xTaskGetTickCount();
+  schedulerTimer = xTimerCreate("scheduler", pdMS_TO_TICKS(SCHEDULER_TICK_MS), pdTRUE, NULL, schedulerTick);
+  xTimerStart(schedulerTimer, 0);
+
+  sntp_set_time_sync_notification_cb(onTimeSynced);
+  configTzTime(schedulerTZ, SCHEDULER_NTP_SERVER);
+
+  registerMetric("scheduler_timers_armed", &schedulerTimersArmed);
+  registerMetric("scheduler_events", &schedulerEvents);
+  registerMetric("scheduler_queue_drops", &schedulerQueueDrops);
+  registerMetric("alarms_fired", &alarmsFired);
+}
+
+// Safe from the web server task; applied by schedulerLoop()
+void setAlarm(int index, const Alarm &alarm)
+{
+  alarms[index] = alarm;
+  alarmsDirty = true;
+}
+
+void clearAlarm(int index)
+{
+  alarms[index].magic = 0;
+  alarmsDirty = true;
+}
+
+void requestSleep(int32_t minutes, uint32_t fadeSeconds)
+{
+  pendingSleepFade = fadeSeconds;
+  pendingSleepMinutes = minutes;
+}
+
+void setTimezone(const char *tz)
+{
+  strlcpy(schedulerTZ, tz, sizeof(schedulerTZ));
+  tzDirty = true;
+}
+
+void schedulerLoop()
+{
+  ScheduledEvent event;
+  while (xQueueReceive(schedulerQueue, &event, 0) == pdTRUE)
+    handleScheduleEvent(event);
+
+  if (tzDirty)
+  {
+    tzDirty = false;
+    setenv("TZ", schedulerTZ, 1);
+    tzset();
+    EEPROM.writeString(TIMEZONE_EPROM_ADDRESS, schedulerTZ);
+    EEPROM.commit();
+    armAllAlarms();
+  }
+
+  if (alarmsDirty)
+  {
+    alarmsDirty = false;
+    EEPROM.put(ALARMS_EPROM_ADDRESS, alarms);
+    EEPROM.commit();
+    armAllAlarms();
+  }
+
+  int32_t minutes = pendingSleepMinutes;
+  if (minutes >= 0)
+  {
+    pendingSleepMinutes = -1;
+    unschedule(EVENT_SLEEP);
+    sleepAt = 0;
+    if (minutes > 0)
+    {
+      sleepFadeSeconds = min((uint32_t)pendingSleepFade, (uint32_t)minutes * 60);
+      scheduleIn(((uint32_t)minutes * 60 - sleepFadeSeconds) * 1000, EVENT_SLEEP, 0);
+      sleepAt = time(nullptr) + minutes * 60;
+    }
+  }
+}
+
+size_t formatAlarms(char *dest, size_t size)
+{
+  time_t now = time(nullptr);
+  struct tm local;
+  localtime_r(&now, &local);
+  size_t len = snprintf(dest, size, "now %02d:%02d %s\n", local.tm_hour, local.tm_min, timeValid() ? schedulerTZ : "unsynced");
+  for (int i = 0; i < MAX_ALARMS && len < size; i++)
+  {
+    const Alarm &a = alarms[i];
+    if (a.magic != ALARM_MAGIC)
+      len += snprintf(dest + len, size - len, "%d off\n", i);
+    else
+      len += snprintf(dest + len, size - len, "%d %02u:%02u days=%02x volume=%u fade=%u %s\n", i, a.hour,
+                      a.minute, a.days, a.volume, a.fadeSeconds, a.url);
+  }
+  if (sleepAt && len < size)
+    len += snprintf(dest + len, size - len, "sleep in %d s\n", (int)(sleepAt - now));
+  return len < size ? len : size - 1;
+}
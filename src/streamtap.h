@@ -0,0 +1,613 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include "Audio.h"
+#include "metrics.h"
+#include "tlsclient.h"
+
+// The stream tap owns the upstream connection: it pulls the compressed
+// stream into a PSRAM ring and audio plays it back through a loopback HTTP
+// relay. Everything that needs the raw bytes (timeshift, recording) reads
+// the same ring at its own absolute stream offset.
+
+#define TAP_ENABLED 1
+#define TAP_RING_SIZE (2 * 1024 * 1024) // power of two, ~2 min at 128 kbps
+#define TAP_WRITE_CHUNK 4096
+#define TAP_RING_GUARD (4 * TAP_WRITE_CHUNK) // never hand out bytes this close to being overwritten
+#define TAP_RELAY_PORT 8081
+#define TAP_MAX_REDIRECTS 5
+#define TAP_CONNECT_TIMEOUT_MS 5000
+#define TAP_METADATA_SIZE 4080 // 255 * 16, the largest ICY metadata block
+#define TAP_RECONNECT_DELAY_MS 1000
+#define TAP_RECONNECT_GIVE_UP_MS 60000
+#define TAP_UNDERRUN_BYTES 4096 // audio's input below this while the ring is empty counts as an underrun
+
+extern Audio audio;
+
+uint8_t *tapRing = nullptr;
+volatile uint32_t tapHead = 0;    // total payload bytes written for the current stream
+volatile uint32_t relayCursor = 0; // next byte the relay hands to audio
+volatile uint32_t tapGeneration = 0;
+volatile bool tapRunning = false;
+volatile bool relayHold = false; // set while playback is paused
+volatile bool timeshiftPaused = false; // paused by /pause, cleared by any new stream or stop
+volatile bool tapTaskAlive = false;
+volatile bool tapAbortConnect = false; // set by tapStop() to give up a connect under way
+TaskHandle_t tapTaskHandle = nullptr; // notified by tapStop() to cut a reconnect back-off short
+portMUX_TYPE tapTaskMux = portMUX_INITIALIZER_UNLOCKED;
+volatile uint32_t tapBufferTargetMs = 2000; // lead to rebuild after an underrun, set by the connectivity manager
+char tapURL[256] = "";
+
+WiFiClient tapPlainClient;
+TlsStreamClient tapSecureClient;
+Client *tapClient = nullptr;
+
+char tapContentType[64] = "";
+char tapStationName[128] = "";
+char tapLogoURL[256] = ""; // icy-logo, sent by a few servers
+volatile uint32_t tapBitrate = 0; // bits per second, from icy-br or the decoder
+uint32_t tapMetaInterval = 0;
+
+// Written by the tap task or the multi-room receiver, shown by tapLoop()
+portMUX_TYPE tapTitleMux = portMUX_INITIALIZER_UNLOCKED;
+char tapPendingTitle[256] = "";
+uint32_t tapPendingTitleOffset = 0;
+bool tapTitlePending = false;
+
+volatile uint32_t tapBytesTotal = 0;
+volatile uint32_t tapRelayRestarts = 0;
+volatile uint32_t tapUpstreamReconnects = 0;
+volatile uint32_t tapRebuffers = 0;
+volatile uint32_t tapLastReconnectMillis = 0;
+
+// Older bytes than the ring holds can be served from elsewhere (timeshift
+// spill); returns bytes copied, 0 if that offset is gone as well.
+size_t (*tapSpillReader)(uint32_t offset, uint8_t *dest, size_t len) = nullptr;
+
+bool tapActive()
+{
+  return tapRunning || tapTaskAlive;
+}
+
+uint32_t tapOldestOffset()
+{
+  uint32_t head = tapHead;
+  return head > TAP_RING_SIZE - TAP_RING_GUARD ? head - (TAP_RING_SIZE - TAP_RING_GUARD) : 0;
+}
+
+uint32_t tapByteRate()
+{
+  uint32_t bitrate = tapBitrate ? tapBitrate : audio.getBitRate();
+  return bitrate ? bitrate / 8 : 16000;
+}
+
+void tapWrite(const uint8_t *data, size_t len)
+{
+  uint32_t head = tapHead;
+  size_t pos = head & (TAP_RING_SIZE - 1);
+  size_t first = min(len, (size_t)(TAP_RING_SIZE - pos));
+  memcpy(tapRing + pos, data, first);
+  memcpy(tapRing, data + first, len - first);
+  tapHead = head + len;
+  tapBytesTotal += len;
+}
+
+// Copies bytes starting at absolute stream offset `offset` out of the ring.
+// Returns -1 once that data has been overwritten, 0 if it has not arrived.
+int tapReadRing(uint32_t offset, uint8_t *dest, size_t len)
+{
+  uint32_t avail = tapHead - offset;
+  if ((int32_t)avail <= 0)
+    return 0;
+  if (avail > TAP_RING_SIZE - TAP_RING_GUARD)
+    return -1;
+  size_t n = min(len, (size_t)avail);
+  size_t pos = offset & (TAP_RING_SIZE - 1);
+  size_t first = min(n, (size_t)(TAP_RING_SIZE - pos));
+  memcpy(dest, tapRing + pos, first);
+  memcpy(dest + first, tapRing, n - first);
+  // The writer may have lapped us while we were copying
+  if (tapHead - offset > TAP_RING_SIZE - TAP_RING_GUARD)
+    return -1;
+  return n;
+}
+
+// Ring first, then spill. Moves `cursor` forward past data that is gone.
+size_t tapReadAt(uint32_t &cursor, uint8_t *dest, size_t len)
+{
+  int n = tapReadRing(cursor, dest, len);
+  if (n >= 0)
+    return n;
+  if (tapSpillReader)
+  {
+    size_t spilled = tapSpillReader(cursor, dest, len);
+    if (spilled > 0)
+      return spilled;
+  }
+  cursor = tapOldestOffset();
+  return 0;
+}
+
+bool readHeaderLine(Client *client, char *line, size_t size)
+{
+  size_t len = 0;
+  uint32_t start = millis();
+  while (millis() - start < TAP_CONNECT_TIMEOUT_MS && !tapAbortConnect)
+  {
+    int c = client->read();
+    if (c < 0)
+    {
+      if (!client->connected())
+        return false;
+      vTaskDelay(1);
+      continue;
+    }
+    if (c == '\n')
+    {
+      if (len > 0 && line[len - 1] == '\r')
+        len--;
+      line[len] = '\0';
+      return true;
+    }
+    if (len + 1 < size)
+      line[len++] = (char)c;
+  }
+  return false;
+}
+
+bool isPlaylistType(const char *contentType)
+{
+  return strstr(contentType, "mpegurl") || strstr(contentType, "scpls") || strstr(contentType, "x-pls") ||
+         strstr(contentType, "text/");
+}
+
+bool tapOpen(const char *url, int redirects)
+{
+  bool secure;
+  const char *rest;
+  if (strncmp(url, "http://", 7) == 0)
+  {
+    secure = false;
+    rest = url + 7;
+  }
+  else if (strncmp(url, "https://", 8) == 0)
+  {
+    secure = true;
+    rest = url + 8;
+  }
+  else
+    return false;
+
+  char host[128];
+  const char *path = strchr(rest, '/');
+  size_t hostLen = path ? path - rest : strlen(rest);
+  if (hostLen == 0 || hostLen >= sizeof(host))
+    return false;
+  memcpy(host, rest, hostLen);
+  host[hostLen] = '\0';
+  if (!path)
+    path = "/";
+
+  uint16_t port = secure ? 443 : 80;
+  char *colon = strchr(host, ':');
+  if (colon)
+  {
+    *colon = '\0';
+    port = atoi(colon + 1);
+  }
+
+  bool connected;
+  if (secure)
+  {
+    tapSecureClient.setHandshakeTimeout(TAP_CONNECT_TIMEOUT_MS);
+    tapSecureClient.setAbortFlag(&tapAbortConnect);
+    tapClient = &tapSecureClient;
+    connected = tapSecureClient.connect(host, port);
+  }
+  else
+  {
+    tapClient = &tapPlainClient;
+    connected = tapPlainClient.connect(host, port, TAP_CONNECT_TIMEOUT_MS);
+  }
+
+  if (!connected)
+  {
+    log_e("Tap cannot connect to %s:%u", host, port);
+    return false;
+  }
+
+  // HTTP/1.0 keeps servers from switching to chunked transfer encoding
+  tapClient->printf("GET %s HTTP/1.0\r\nHost: %s\r\nIcy-MetaData: 1\r\nUser-Agent: ARadio\r\nAccept: */*\r\n\r\n", path, host);
+
+  char line[512];
+  if (!readHeaderLine(tapClient, line, sizeof(line)))
+  {
+    tapClient->stop();
+    return false;
+  }
+  const char *status = strchr(line, ' ');
+  int code = status ? atoi(status + 1) : 0;
+
+  char location[256] = "";
+  tapContentType[0] = '\0';
+  tapStationName[0] = '\0';
+  tapLogoURL[0] = '\0';
+  tapMetaInterval = 0;
+  tapBitrate = 0;
+  while (readHeaderLine(tapClient, line, sizeof(line)) && line[0] != '\0')
+  {
+    char *value = strchr(line, ':');
+    if (!value)
+      continue;
+    *value++ = '\0';
+    while (*value == ' ')
+      value++;
+    if (strcasecmp(line, "content-type") == 0)
+    {
+      strlcpy(tapContentType, value, sizeof(tapContentType));
+      for (char *p = tapContentType; *p; p++)
+        *p = tolower(*p);
+    }
+    else if (strcasecmp(line, "location") == 0)
+      strlcpy(location, value, sizeof(location));
+    else if (strcasecmp(line, "icy-metaint") == 0)
+      tapMetaInterval = atoi(value);
+    else if (strcasecmp(line, "icy-name") == 0)
+      strlcpy(tapStationName, value, sizeof(tapStationName));
+    else if (strcasecmp(line, "icy-br") == 0)
+      tapBitrate = atoi(value) * 1000;
+    else if (strcasecmp(line, "icy-logo") == 0)
+      strlcpy(tapLogoURL, value, sizeof(tapLogoURL));
+  }
+
+  if (code >= 300 && code < 400 && location[0] && redirects > 0)
+  {
+    tapClient->stop();
+    return tapOpen(location, redirects - 1);
+  }
+
+  // Playlists and anything else audio knows better how to handle
+  if (code != 200 || tapContentType[0] == '\0' || isPlaylistType(tapContentType))
+  {
+    tapClient->stop();
+    return false;
+  }
+  return true;
+}
+
+void parseIcyMetadata(const char *meta, uint32_t offset)
+{
+  const char *title = strstr(meta, "StreamTitle='");
+  if (!title)
+    return;
+  title += 13;
+  const char *end = strstr(title, "';");
+  size_t len = end ? end - title : strlen(title);
+  len = min(len, sizeof(tapPendingTitle) - 1);
+  portENTER_CRITICAL(&tapTitleMux);
+  memcpy(tapPendingTitle, title, len);
+  tapPendingTitle[len] = '\0';
+  tapPendingTitleOffset = offset;
+  tapTitlePending = true;
+  portEXIT_CRITICAL(&tapTitleMux);
+}
+
+// The upstream dropped (Wi-Fi roam, AP reboot, server hiccup). Reopen it
+// while the relay keeps playing what is already in the ring.
+bool tapReconnect()
+{
+  tapClient->stop();
+  uint32_t start = millis();
+  while (tapRunning && millis() - start < TAP_RECONNECT_GIVE_UP_MS)
+  {
+    if (WiFi.status() == WL_CONNECTED && tapOpen(tapURL, TAP_MAX_REDIRECTS))
+    {
+      tapUpstreamReconnects++;
+      tapLastReconnectMillis = millis();
+      Serial.printf("tap         upstream back after %u ms\n", (unsigned)(millis() - start));
+      return true;
+    }
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TAP_RECONNECT_DELAY_MS));
+  }
+  return false;
+}
+
+void tapTask(void *param)
+{
+  static uint8_t buf[TAP_WRITE_CHUNK];
+  static char meta[TAP_METADATA_SIZE + 1];
+  uint32_t untilMeta = tapMetaInterval;
+  size_t metaLen = 0, metaFill = 0;
+  bool inMeta = false;
+
+  while (tapRunning)
+  {
+    int n = tapClient->read(buf, sizeof(buf));
+    if (n <= 0)
+    {
+      if (!tapClient->connected())
+      {
+        if (!tapRunning || !tapReconnect())
+          break;
+        // The new response starts a fresh metadata interval
+        untilMeta = tapMetaInterval;
+        inMeta = false;
+        continue;
+      }
+      vTaskDelay(pdMS_TO_TICKS(5));
+      continue;
+    }
+
+    // Strip ICY metadata blocks, the ring only holds codec payload
+    int i = 0;
+    while (i < n)
+    {
+      if (inMeta)
+      {
+        size_t take = min((size_t)(n - i), metaLen - metaFill);
+        memcpy(meta + metaFill, buf + i, take);
+        metaFill += take;
+        i += take;
+        if (metaFill == metaLen)
+        {
+          meta[metaLen] = '\0';
+          parseIcyMetadata(meta, tapHead);
+          inMeta = false;
+          untilMeta = tapMetaInterval;
+        }
+      }
+      else if (tapMetaInterval && untilMeta == 0)
+      {
+        metaLen = buf[i++] * 16;
+        metaFill = 0;
+        inMeta = metaLen > 0;
+        if (!inMeta)
+          untilMeta = tapMetaInterval;
+      }
+      else
+      {
+        size_t take = n - i;
+        if (tapMetaInterval)
+          take = min(take, (size_t)untilMeta);
+        tapWrite(buf + i, take);
+        i += take;
+        untilMeta -= tapMetaInterval ? take : 0;
+      }
+    }
+  }
+
+  tapClient->stop();
+  tapRunning = false;
+  portENTER_CRITICAL(&tapTaskMux);
+  tapTaskHandle = nullptr;
+  portEXIT_CRITICAL(&tapTaskMux);
+  tapTaskAlive = false;
+  vTaskDelete(NULL);
+}
+
+bool tapStart(const char *url)
+{
+  tapAbortConnect = false;
+  if (!tapRing || !tapOpen(url, TAP_MAX_REDIRECTS))
+    return false;
+  strlcpy(tapURL, url, sizeof(tapURL));
+  tapHead = 0;
+  relayCursor = 0;
+  portENTER_CRITICAL(&tapTitleMux);
+  tapTitlePending = false;
+  portEXIT_CRITICAL(&tapTitleMux);
+  tapGeneration++;
+  tapRunning = true;
+  tapTaskAlive = true;
+  // TLS records and reconnect handshakes need the extra stack
+  xTaskCreatePinnedToCore(tapTask, "streamTap", 8192, NULL, 3, &tapTaskHandle, 0);
+  return true;
+}
+
+// Start a tap that is fed by someone else (a multi-room leader) instead of
+// an upstream connection. `start` is the stream offset of the first byte.
+void tapStartExternal(uint32_t start, const char *contentType, const char *name, uint32_t bitrate)
+{
+  strlcpy(tapContentType, contentType, sizeof(tapContentType));
+  strlcpy(tapStationName, name, sizeof(tapStationName));
+  tapLogoURL[0] = '\0';
+  tapBitrate = bitrate;
+  tapHead = start;
+  relayCursor = start;
+  portENTER_CRITICAL(&tapTitleMux);
+  tapTitlePending = false;
+  portEXIT_CRITICAL(&tapTitleMux);
+  tapGeneration++;
+  tapRunning = true;
+}
+
+// Place bytes at their stream offset; gaps from lost packets are zero
+// filled so offsets stay comparable with the producer's
+void tapWriteAt(uint32_t offset, const uint8_t *data, size_t len)
+{
+  static const uint8_t zeros[256] = {};
+  int32_t gap = (int32_t)(offset - tapHead);
+  if (gap < 0)
+  {
+    if ((size_t)-gap >= len)
+      return; // duplicate or late
+    data += -gap;
+    len -= -gap;
+  }
+  else if (gap > TAP_RING_SIZE / 2)
+    tapHead = offset; // too far behind to fill, start over
+  while ((int32_t)(offset - tapHead) > 0)
+    tapWrite(zeros, min(sizeof(zeros), (size_t)(offset - tapHead)));
+  tapWrite(data, len);
+}
+
+void tapStop()
+{
+  if (!tapActive())
+    return;
+  tapRunning = false;
+  // Wakes the task if it is waiting between reconnect attempts. An attempt
+  // under way drops an HTTPS connect or a header read at once; a plain
+  // HTTP connect or a TLS handshake is bounded by TAP_CONNECT_TIMEOUT_MS.
+  tapAbortConnect = true;
+  portENTER_CRITICAL(&tapTaskMux);
+  if (tapTaskHandle)
+    xTaskNotifyGive(tapTaskHandle);
+  portEXIT_CRITICAL(&tapTaskMux);
+  while (tapTaskAlive)
+    vTaskDelay(pdMS_TO_TICKS(5));
+  tapGeneration++;
+}
+
+WiFiServer relayServer(TAP_RELAY_PORT);
+
+// Serves the ring to audio over loopback. A new request (for example a seek
+// with ?offset=) replaces the one being served.
+void relayTask(void *param)
+{
+  static uint8_t buf[TAP_WRITE_CHUNK];
+  relayServer.begin();
+  for (;;)
+  {
+    WiFiClient client = relayServer.accept();
+    if (!client)
+    {
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
+    }
+
+    char line[256];
+    uint32_t cursor = tapOldestOffset() > relayCursor ? tapOldestOffset() : relayCursor;
+    if (readHeaderLine(&client, line, sizeof(line)))
+    {
+      const char *offset = strstr(line, "offset=");
+      if (offset)
+        cursor = strtoul(offset + 7, NULL, 10);
+      while (readHeaderLine(&client, line, sizeof(line)) && line[0] != '\0')
+        ;
+    }
+    relayCursor = cursor;
+    tapRelayRestarts++;
+
+    client.printf("HTTP/1.0 200 OK\r\nContent-Type: %s\r\n", tapContentType);
+    if (tapStationName[0])
+      client.printf("icy-name: %s\r\n", tapStationName);
+    client.print("\r\n");
+
+    uint32_t generation = tapGeneration;
+    bool rebuffering = false, fed = false;
+    while (client.connected() && generation == tapGeneration && !relayServer.hasClient())
+    {
+      if (relayHold)
+      {
+        vTaskDelay(pdMS_TO_TICKS(20));
+        continue;
+      }
+      // After an underrun, wait for a cushion before feeding audio again so
+      // a flaky link gives one longer gap rather than constant stutter
+      if (rebuffering)
+      {
+        uint32_t target = tapByteRate() * tapBufferTargetMs / 1000;
+        if (tapHead - cursor < target && tapRunning)
+        {
+          vTaskDelay(pdMS_TO_TICKS(20));
+          continue;
+        }
+        rebuffering = false;
+      }
+      uint32_t from = cursor;
+      size_t n = tapReadAt(cursor, buf, sizeof(buf));
+      if (n == 0)
+      {
+        relayCursor = cursor;
+        if (cursor == from && !tapActive())
+          break; // upstream ended and everything was handed over
+        if (fed && cursor == from && audio.inBufferFilled() < TAP_UNDERRUN_BYTES)
+        {
+          rebuffering = true;
+          tapRebuffers++;
+        }
+        vTaskDelay(pdMS_TO_TICKS(5));
+        continue;
+      }
+      // Blocks while audio's input buffer is full
+      size_t written = client.write(buf, n);
+      if (written == 0)
+        break;
+      cursor += written;
+      relayCursor = cursor;
+      fed = true;
+    }
+    client.stop();
+  }
+}
+
+void setupStreamTap()
+{
+#if TAP_ENABLED
+  tapRing = (uint8_t *)ps_malloc(TAP_RING_SIZE);
+  if (!tapRing)
+  {
+    log_e("No PSRAM for the stream tap, playing streams directly");
+    return;
+  }
+  xTaskCreatePinnedToCore(relayTask, "streamRelay", 4096, NULL, 3, NULL, 0);
+  setupTls();
+  registerMetric("tap_bytes_total", &tapBytesTotal);
+  registerMetric("tap_head", &tapHead);
+  registerMetric("tap_relay_cursor", &relayCursor);
+  registerMetric("tap_relay_restarts", &tapRelayRestarts);
+  registerMetric("tap_upstream_reconnects", &tapUpstreamReconnects);
+  registerMetric("tap_rebuffers", &tapRebuffers);
+  registerMetric("tap_buffer_target_ms", &tapBufferTargetMs);
+#endif
+}
+
+void relayURL(char *dest, size_t destSize, uint32_t offset)
+{
+  snprintf(dest, destSize, "http://127.0.0.1:%d/tap?offset=%u", TAP_RELAY_PORT, (unsigned)offset);
+}
+
+// Play `url` through the tap when possible, directly otherwise
+bool connectStream(const char *url)
+{
+  tapStop();
+  relayHold = false;
+  timeshiftPaused = false;
+  if (tapStart(url))
+  {
+    char relay[64];
+    relayURL(relay, sizeof(relay), 0);
+    if (audio.connecttohost(relay))
+      return true;
+    tapStop();
+  }
+  return audio.connecttohost(url);
+}
+
+void stopStream()
+{
+  audio.stopSong();
+  tapStop();
+  relayHold = false;
+  timeshiftPaused = false;
+}
+
+// Titles are held back until playback reaches the point they arrived at
+void tapLoop()
+{
+  // Copied out under the lock, shown outside it
+  char title[sizeof(tapPendingTitle)];
+  bool due = false;
+  portENTER_CRITICAL(&tapTitleMux);
+  if (tapTitlePending && (int32_t)(relayCursor - tapPendingTitleOffset) >= 0)
+  {
+    tapTitlePending = false;
+    memcpy(title, tapPendingTitle, sizeof(title));
+    due = true;
+  }
+  portEXIT_CRITICAL(&tapTitleMux);
+  if (due)
+    audio_showstreamtitle(title);
+}
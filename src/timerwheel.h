@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdint.h>
+
+// Hierarchical timer wheel: four levels of 64 slots, each level 64 times
+// coarser than the one below. Adding and cancelling are O(1); advancing one
+// tick touches a single level-0 slot and, every 64 ticks, moves one coarser
+// slot down a level. With 100 ms ticks it reaches about 19 days ahead.
+// Timers live in a fixed pool, so nothing is allocated after construction.
+// No Arduino headers, and no locking: the owner serialises access.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_TIMERS 16
+#define WHEEL_MAX_TICKS ((1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct WheelTimer
+{
+  uint32_t expires; // absolute tick
+  uint32_t arg;
+  uint8_t type;
+  bool armed;
+  int8_t next; // slot list, -1 terminated
+  int8_t prev;
+  int8_t level;
+  uint8_t slot;
+};
+
+struct TimerWheel
+{
+  WheelTimer timers[WHEEL_MAX_TIMERS];
+  int8_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint32_t now = 0;
+  uint32_t armedCount = 0;
+
+  TimerWheel()
+  {
+    for (int l = 0; l < WHEEL_LEVELS; l++)
+      for (int s = 0; s < WHEEL_SLOTS; s++)
+        slots[l][s] = -1;
+    for (int i = 0; i < WHEEL_MAX_TIMERS; i++)
+      timers[i].armed = false;
+  }
+
+  // Fires `delay` ticks from now (at least one); returns the timer id or -1
+  // when the pool is exhausted or the delay is out of range
+  int add(uint32_t delay, uint8_t type, uint32_t arg)
+  {
+    if (delay == 0)
+      delay = 1;
+    if (delay > WHEEL_MAX_TICKS)
+      return -1;
+    for (int i = 0; i < WHEEL_MAX_TIMERS; i++)
+    {
+      if (timers[i].armed)
+        continue;
+      timers[i].expires = now + delay;
+      timers[i].type = type;
+      timers[i].arg = arg;
+      timers[i].armed = true;
+      armedCount++;
+      place(i);
+      return i;
+    }
+    return -1;
+  }
+
+  void cancel(int id)
+  {
+    if (id < 0 || id >= WHEEL_MAX_TIMERS || !timers[id].armed)
+      return;
+    unlink(id);
+    timers[id].armed = false;
+    armedCount--;
+  }
+
+  // Cancel every timer of `type`, or only those with `arg` as well
+  void cancelType(uint8_t type, int64_t arg = -1)
+  {
+    for (int i = 0; i < WHEEL_MAX_TIMERS; i++)
+      if (timers[i].armed && timers[i].type == type && (arg < 0 || timers[i].arg == (uint32_t)arg))
+        cancel(i);
+  }
+
+  // Moves time forward one tick at a time, calling fire(type, arg) for
+  // each timer that expires. Timers may be added from inside fire().
+  template <typename F>
+  void advance(uint32_t ticks, F fire)
+  {
+    while (ticks--)
+    {
+      now++;
+      // Bring the next coarser slot down whenever a level wraps around
+      for (int level = 1; level < WHEEL_LEVELS; level++)
+      {
+        if ((now & ((1u << (WHEEL_BITS * level)) - 1)) != 0)
+          break;
+        cascade(level, (now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+      }
+
+      int8_t *slot = &slots[0][now & WHEEL_MASK];
+      while (*slot >= 0)
+      {
+        int id = *slot;
+        unlink(id);
+        timers[id].armed = false;
+        armedCount--;
+        fire(timers[id].type, timers[id].arg);
+      }
+    }
+  }
+
+private:
+  void place(int id)
+  {
+    WheelTimer &t = timers[id];
+    uint32_t delta = t.expires - now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1u << (WHEEL_BITS * (level + 1))))
+      level++;
+    t.level = level;
+    t.slot = (t.expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    t.prev = -1;
+    t.next = slots[level][t.slot];
+    if (t.next >= 0)
+      timers[t.next].prev = id;
+    slots[level][t.slot] = id;
+  }
+
+  void unlink(int id)
+  {
+    WheelTimer &t = timers[id];
+    if (t.prev >= 0)
+      timers[t.prev].next = t.next;
+    else
+      slots[t.level][t.slot] = t.next;
+    if (t.next >= 0)
+      timers[t.next].prev = t.prev;
+  }
+
+  void cascade(int level, uint32_t index)
+  {
+    int8_t id = slots[level][index];
+    slots[level][index] = -1;
+    while (id >= 0)
+    {
+      int8_t next = timers[id].next;
+      place(id);
+      id = next;
+    }
+  }
+};
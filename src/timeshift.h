@@ -0,0 +1,679 @@
+#pragma once
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <esp_partition.h>
+#include "streamtap.h"
+#include "metrics.h"
+
+// Timeshift and recording on top of the stream tap. When playback falls far
+// enough behind live, or while recording, a low-priority task copies the
+// ring into append-only segment files; the relay reads them back once the
+// ring has moved on. /tap/index gets one SpillSegment record per closed
+// segment so recordings survive a reboot. A recording is the run of
+// segments tagged with its id (the id of its first segment); recordings can
+// be listed, downloaded and deleted, and are kept under a share of the flash
+// by dropping the oldest first.
+
+#define SPILL_DIR "/tap"
+#define SPILL_INDEX_PATH "/tap/index"
+#define SPILL_SEGMENT_SIZE (256 * 1024)
+#define SPILL_BATCH_SIZE (16 * 1024)
+#define SPILL_MAX_SEGMENTS 32
+#define SPILL_MIN_FREE_BYTES (2 * SPILL_SEGMENT_SIZE)
+#define SPILL_THRESHOLD (TAP_RING_SIZE / 2) // start spilling once playback lags live by this much
+#define SPILL_SEGMENT_RECORDED 0x01
+#define SPILL_RECORDING_SHIFT 8 // flags above this hold the recording id
+#define NO_RECORDING 0xFFFFFF
+#define MAX_RECORDINGS 16
+#define RECORDING_QUOTA_PERCENT 60 // of the LittleFS partition
+
+struct SpillSegment
+{
+  uint32_t id;
+  uint32_t start;  // stream offset of the first byte
+  uint32_t length;
+  uint32_t flags;
+};
+
+SpillSegment spillSegments[SPILL_MAX_SEGMENTS]; // current stream only, oldest first
+int spillSegmentCount = 0;
+uint32_t nextSpillSegmentId = 0;
+SemaphoreHandle_t spillLock = nullptr;
+uint8_t *spillBatch = nullptr;
+
+File spillWriteFile;
+File spillReadFile;
+uint32_t spillReadFileId = UINT32_MAX;
+
+bool timeshiftReady = false;
+volatile bool recording = false;
+volatile uint32_t activeRecordingId = NO_RECORDING; // assigned when its first segment opens
+
+volatile uint32_t spillBytesTotal = 0;
+volatile uint32_t spillSegmentsGauge = 0;
+volatile uint32_t spillOverruns = 0;
+volatile uint32_t recordingGauge = 0;
+volatile uint32_t recordingsDropped = 0;
+
+struct RecordingInfo
+{
+  uint32_t id;
+  uint32_t bytes;
+  uint16_t segments;
+};
+
+void spillPath(char *dest, size_t destSize, uint32_t id)
+{
+  snprintf(dest, destSize, SPILL_DIR "/%08u.seg", (unsigned)id);
+}
+
+void appendSpillIndex(const SpillSegment &segment)
+{
+  File index = LittleFS.open(SPILL_INDEX_PATH, FILE_APPEND);
+  if (!index)
+    return;
+  index.write((const uint8_t *)&segment, sizeof(segment));
+  index.close();
+}
+
+// Called with spillLock held
+void removeSpillSegment(int i)
+{
+  char path[32];
+  spillPath(path, sizeof(path), spillSegments[i].id);
+  if (spillReadFileId == spillSegments[i].id)
+  {
+    spillReadFile.close();
+    spillReadFileId = UINT32_MAX;
+  }
+  LittleFS.remove(path);
+  memmove(&spillSegments[i], &spillSegments[i + 1], (spillSegmentCount - i - 1) * sizeof(SpillSegment));
+  spillSegmentCount--;
+  spillSegmentsGauge = spillSegmentCount;
+}
+
+void closeSpillSegment()
+{
+  if (!spillWriteFile)
+    return;
+  spillWriteFile.close();
+  xSemaphoreTake(spillLock, portMAX_DELAY);
+  appendSpillIndex(spillSegments[spillSegmentCount - 1]);
+  xSemaphoreGive(spillLock);
+}
+
+void stopRecording()
+{
+  recording = false;
+  recordingGauge = 0;
+  activeRecordingId = NO_RECORDING;
+}
+
+uint32_t segmentRecordingId(const SpillSegment &segment)
+{
+  return segment.flags >> SPILL_RECORDING_SHIFT;
+}
+
+// Groups the closed recorded segments in the index into recordings, oldest
+// first, and adds up their size. Called with spillLock held.
+int readRecordings(RecordingInfo *list, int max, uint32_t *totalBytes)
+{
+  int count = 0;
+  *totalBytes = 0;
+  File index = LittleFS.open(SPILL_INDEX_PATH, FILE_READ);
+  if (!index)
+    return 0;
+  SpillSegment segment;
+  while (index.read((uint8_t *)&segment, sizeof(segment)) == sizeof(segment))
+  {
+    if (!(segment.flags & SPILL_SEGMENT_RECORDED))
+      continue;
+    *totalBytes += segment.length;
+    uint32_t id = segmentRecordingId(segment);
+    int i = 0;
+    while (i < count && list[i].id != id)
+      i++;
+    if (i == count)
+    {
+      if (count == max)
+        continue;
+      list[count++] = {id, 0, 0};
+    }
+    list[i].bytes += segment.length;
+    list[i].segments++;
+  }
+  index.close();
+  return count;
+}
+
+// Deletes every segment of recording `id` and rewrites the index without
+// them. False if it is unknown or still being written. Called with spillLock held.
+bool removeRecording(uint32_t id)
+{
+  if (id == activeRecordingId)
+    return false;
+  if (spillWriteFile && spillSegmentCount > 0 &&
+      (spillSegments[spillSegmentCount - 1].flags & SPILL_SEGMENT_RECORDED) &&
+      segmentRecordingId(spillSegments[spillSegmentCount - 1]) == id)
+    return false;
+
+  for (int i = spillSegmentCount - 1; i >= 0; i--)
+    if ((spillSegments[i].flags & SPILL_SEGMENT_RECORDED) && segmentRecordingId(spillSegments[i]) == id)
+      removeSpillSegment(i);
+
+  File index = LittleFS.open(SPILL_INDEX_PATH, FILE_READ);
+  File rewritten = LittleFS.open(SPILL_INDEX_PATH ".new", FILE_WRITE);
+  if (!index || !rewritten)
+  {
+    index.close();
+    rewritten.close();
+    return false;
+  }
+  bool found = false;
+  SpillSegment segment;
+  while (index.read((uint8_t *)&segment, sizeof(segment)) == sizeof(segment))
+  {
+    if ((segment.flags & SPILL_SEGMENT_RECORDED) && segmentRecordingId(segment) == id)
+    {
+      // Segments of earlier streams are only known to the index
+      char path[32];
+      spillPath(path, sizeof(path), segment.id);
+      LittleFS.remove(path);
+      found = true;
+      continue;
+    }
+    rewritten.write((const uint8_t *)&segment, sizeof(segment));
+  }
+  index.close();
+  rewritten.close();
+  LittleFS.remove(SPILL_INDEX_PATH);
+  LittleFS.rename(SPILL_INDEX_PATH ".new", SPILL_INDEX_PATH);
+  return found;
+}
+
+// Called with spillLock held
+bool dropOldestRecording()
+{
+  RecordingInfo list[MAX_RECORDINGS];
+  uint32_t total;
+  int count = readRecordings(list, MAX_RECORDINGS, &total);
+  for (int i = 0; i < count; i++)
+  {
+    if (removeRecording(list[i].id))
+    {
+      recordingsDropped++;
+      Serial.printf("timeshift   dropped recording %u (%u bytes) to make room\n", (unsigned)list[i].id, (unsigned)list[i].bytes);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Keeps recordings under RECORDING_QUOTA_PERCENT of the flash before another
+// recorded segment opens. Called with spillLock held.
+bool makeRecordingRoom()
+{
+  uint32_t quota = LittleFS.totalBytes() / 100 * RECORDING_QUOTA_PERCENT;
+  for (;;)
+  {
+    RecordingInfo list[MAX_RECORDINGS];
+    uint32_t total;
+    readRecordings(list, MAX_RECORDINGS, &total);
+    if (total + SPILL_SEGMENT_SIZE <= quota)
+      return true;
+    if (!dropOldestRecording())
+      return false;
+  }
+}
+
+// Timeshift segments of the previous stream are useless, recordings stay on
+// flash but leave the in-memory index
+void resetSpill()
+{
+  closeSpillSegment();
+  xSemaphoreTake(spillLock, portMAX_DELAY);
+  for (int i = spillSegmentCount - 1; i >= 0; i--)
+  {
+    if (spillSegments[i].flags & SPILL_SEGMENT_RECORDED)
+    {
+      memmove(&spillSegments[i], &spillSegments[i + 1], (spillSegmentCount - i - 1) * sizeof(SpillSegment));
+      spillSegmentCount--;
+    }
+    else
+      removeSpillSegment(i);
+  }
+  spillReadFile.close();
+  spillReadFileId = UINT32_MAX;
+  spillSegmentsGauge = spillSegmentCount;
+  xSemaphoreGive(spillLock);
+}
+
+bool openSpillSegment(uint32_t start)
+{
+  xSemaphoreTake(spillLock, portMAX_DELAY);
+  if (recording && !makeRecordingRoom())
+  {
+    xSemaphoreGive(spillLock);
+    log_e("Recording quota reached");
+    return false;
+  }
+  // Make room by dropping the oldest timeshift segment, then the oldest
+  // recording that is not being written
+  while (spillSegmentCount >= SPILL_MAX_SEGMENTS ||
+         LittleFS.totalBytes() - LittleFS.usedBytes() < SPILL_MIN_FREE_BYTES)
+  {
+    int victim = -1;
+    for (int i = 0; i < spillSegmentCount; i++)
+    {
+      if (!(spillSegments[i].flags & SPILL_SEGMENT_RECORDED))
+      {
+        victim = i;
+        break;
+      }
+    }
+    if (victim >= 0)
+      removeSpillSegment(victim);
+    else if (!dropOldestRecording())
+    {
+      xSemaphoreGive(spillLock);
+      log_e("Timeshift storage full");
+      return false;
+    }
+  }
+
+  SpillSegment &segment = spillSegments[spillSegmentCount];
+  segment.id = nextSpillSegmentId++;
+  segment.start = start;
+  segment.length = 0;
+  segment.flags = 0;
+  if (recording)
+  {
+    if (activeRecordingId == NO_RECORDING)
+      activeRecordingId = segment.id & NO_RECORDING;
+    segment.flags = SPILL_SEGMENT_RECORDED | (activeRecordingId << SPILL_RECORDING_SHIFT);
+  }
+
+  char path[32];
+  spillPath(path, sizeof(path), segment.id);
+  spillWriteFile = LittleFS.open(path, FILE_WRITE);
+  if (spillWriteFile)
+  {
+    spillSegmentCount++;
+    spillSegmentsGauge = spillSegmentCount;
+  }
+  xSemaphoreGive(spillLock);
+  return (bool)spillWriteFile;
+}
+
+// tapSpillReader: serves offsets the ring no longer holds
+size_t spillRead(uint32_t offset, uint8_t *dest, size_t len)
+{
+  size_t n = 0;
+  xSemaphoreTake(spillLock, portMAX_DELAY);
+  for (int i = 0; i < spillSegmentCount; i++)
+  {
+    const SpillSegment &segment = spillSegments[i];
+    uint32_t into = offset - segment.start;
+    if (into >= segment.length)
+      continue;
+    if (spillReadFileId != segment.id)
+    {
+      char path[32];
+      spillPath(path, sizeof(path), segment.id);
+      spillReadFile.close();
+      spillReadFile = LittleFS.open(path, FILE_READ);
+      spillReadFileId = spillReadFile ? segment.id : UINT32_MAX;
+    }
+    if (spillReadFile && spillReadFile.seek(into))
+      n = spillReadFile.read(dest, min(len, (size_t)(segment.length - into)));
+    break;
+  }
+  xSemaphoreGive(spillLock);
+  return n;
+}
+
+void spillTask(void *param)
+{
+  uint32_t generation = tapGeneration;
+  uint32_t cursor = 0;
+
+  for (;;)
+  {
+    if (generation != tapGeneration)
+    {
+      resetSpill();
+      stopRecording();
+      generation = tapGeneration;
+      cursor = 0;
+    }
+
+    bool wanted = tapActive() && (recording || tapHead - relayCursor > SPILL_THRESHOLD);
+    if (!wanted)
+    {
+      closeSpillSegment();
+      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
+
+    // Only keep what playback (or the recording) still needs
+    if (!spillWriteFile && !recording && (int32_t)(relayCursor - cursor) > 0)
+      cursor = relayCursor;
+    if ((int32_t)(tapOldestOffset() - cursor) > 0)
+    {
+      closeSpillSegment();
+      cursor = tapOldestOffset();
+      spillOverruns++;
+    }
+
+    // Write in large batches, flash writes stall both cores
+    if (tapHead - cursor < SPILL_BATCH_SIZE)
+    {
+      vTaskDelay(pdMS_TO_TICKS(50));
+      continue;
+    }
+    int n = tapReadRing(cursor, spillBatch, SPILL_BATCH_SIZE);
+    if (n <= 0)
+      continue;
+
+    if (spillWriteFile)
+    {
+      const SpillSegment &current = spillSegments[spillSegmentCount - 1];
+      bool recordedChanged = ((current.flags & SPILL_SEGMENT_RECORDED) != 0) != recording ||
+                             (recording && segmentRecordingId(current) != activeRecordingId);
+      if (current.length + n > SPILL_SEGMENT_SIZE || recordedChanged)
+        closeSpillSegment();
+    }
+    if (!spillWriteFile && !openSpillSegment(cursor))
+    {
+      stopRecording();
+      vTaskDelay(pdMS_TO_TICKS(1000));
+      continue;
+    }
+
+    size_t written = spillWriteFile.write(spillBatch, n);
+    spillWriteFile.flush();
+    xSemaphoreTake(spillLock, portMAX_DELAY);
+    spillSegments[spillSegmentCount - 1].length += written;
+    xSemaphoreGive(spillLock);
+    spillBytesTotal += written;
+    cursor += written;
+    if (written != (size_t)n)
+      closeSpillSegment();
+  }
+}
+
+// Drop leftover timeshift segments from the last run, keep recordings
+void cleanupSpillDir()
+{
+  if (!LittleFS.exists(SPILL_DIR))
+    LittleFS.mkdir(SPILL_DIR);
+
+  static SpillSegment kept[SPILL_MAX_SEGMENTS * 4]; // 2 KiB, too much for a task stack
+  int keptCount = 0;
+  File index = LittleFS.open(SPILL_INDEX_PATH, FILE_READ);
+  if (index)
+  {
+    SpillSegment segment;
+    while (index.read((uint8_t *)&segment, sizeof(segment)) == sizeof(segment))
+    {
+      if ((segment.flags & SPILL_SEGMENT_RECORDED) && keptCount < (int)(sizeof(kept) / sizeof(kept[0])))
+        kept[keptCount++] = segment;
+      if (segment.id >= nextSpillSegmentId)
+        nextSpillSegmentId = segment.id + 1;
+    }
+    index.close();
+  }
+
+  File dir = LittleFS.open(SPILL_DIR);
+  File entry;
+  while ((entry = dir.openNextFile()))
+  {
+    uint32_t id = strtoul(entry.name(), NULL, 10);
+    bool isSegment = strstr(entry.name(), ".seg") != nullptr;
+    entry.close();
+    if (!isSegment)
+      continue;
+    if (id >= nextSpillSegmentId)
+      nextSpillSegmentId = id + 1;
+    bool keep = false;
+    for (int i = 0; i < keptCount && !keep; i++)
+      keep = kept[i].id == id;
+    if (!keep)
+    {
+      char path[32];
+      spillPath(path, sizeof(path), id);
+      LittleFS.remove(path);
+    }
+  }
+  dir.close();
+
+  LittleFS.remove(SPILL_INDEX_PATH);
+  for (int i = 0; i < keptCount; i++)
+    appendSpillIndex(kept[i]);
+}
+
+// True when the filesystem partition was never written (its superblocks
+// are still erased), so formatting it loses nothing
+bool spillPartitionBlank()
+{
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+  if (!partition)
+    return false;
+  uint8_t block[256];
+  for (size_t offset = 0; offset < 2 * 4096 && offset < partition->size; offset += sizeof(block))
+  {
+    if (esp_partition_read(partition, offset, block, sizeof(block)) != ESP_OK)
+      return false;
+    for (size_t i = 0; i < sizeof(block); i++)
+      if (block[i] != 0xFF)
+        return false;
+  }
+  return true;
+}
+
+void setupTimeshift()
+{
+  if (!tapRing)
+    return;
+  // Only a blank partition is formatted. A mount error on one with data
+  // must not wipe the recordings on it.
+  if (!LittleFS.begin(false) && !(spillPartitionBlank() && LittleFS.begin(true)))
+  {
+    log_e("LittleFS mount failed, left unformatted, timeshift limited to RAM");
+    return;
+  }
+  spillBatch = (uint8_t *)ps_malloc(SPILL_BATCH_SIZE);
+  spillLock = xSemaphoreCreateMutex();
+  if (!spillBatch || !spillLock)
+    return;
+  cleanupSpillDir();
+  tapSpillReader = spillRead;
+  timeshiftReady = true;
+  xTaskCreatePinnedToCore(spillTask, "spill", 4096, NULL, 1, NULL, 0);
+
+  registerMetric("spill_bytes_total", &spillBytesTotal);
+  registerMetric("spill_segments", &spillSegmentsGauge);
+  registerMetric("spill_overruns", &spillOverruns);
+  registerMetric("recording", &recordingGauge);
+  registerMetric("recordings_dropped", &recordingsDropped);
+}
+
+uint32_t timeshiftOldestOffset()
+{
+  uint32_t oldest = tapOldestOffset();
+  if (spillLock)
+  {
+    xSemaphoreTake(spillLock, portMAX_DELAY);
+    for (int i = 0; i < spillSegmentCount; i++)
+    {
+      if ((int32_t)(oldest - spillSegments[i].start) > 0)
+        oldest = spillSegments[i].start;
+    }
+    xSemaphoreGive(spillLock);
+  }
+  return oldest;
+}
+
+// Seconds between what is playing and the live edge
+uint32_t timeshiftBehindSeconds()
+{
+  return (tapHead - relayCursor) / tapByteRate();
+}
+
+bool timeshiftPause()
+{
+  if (!tapActive() || timeshiftPaused)
+    return false;
+  relayHold = true;
+  audio.pauseResume();
+  timeshiftPaused = true;
+  return true;
+}
+
+bool timeshiftResume()
+{
+  if (!timeshiftPaused)
+    return false;
+  audio.pauseResume();
+  relayHold = false;
+  timeshiftPaused = false;
+  return true;
+}
+
+// Restart playback `secondsBehindLive` seconds before the live edge,
+// clamped to the oldest byte still in RAM or on flash
+bool timeshiftSeek(uint32_t secondsBehindLive)
+{
+  if (!tapActive())
+    return false;
+  uint32_t head = tapHead;
+  uint32_t behind = min(secondsBehindLive * tapByteRate(), head);
+  uint32_t target = head - behind;
+  uint32_t oldest = timeshiftOldestOffset();
+  if ((int32_t)(oldest - target) > 0)
+    target = oldest;
+
+  char relay[64];
+  relayURL(relay, sizeof(relay), target);
+  relayHold = false;
+  timeshiftPaused = false;
+  return audio.connecttohost(relay);
+}
+
+bool timeshiftRecord(bool enable)
+{
+  if (!enable)
+  {
+    stopRecording();
+    return true;
+  }
+  if (!tapActive() || !timeshiftReady)
+    return false;
+  recording = true;
+  recordingGauge = 1;
+  return true;
+}
+
+// [{"id":3,"bytes":524288,"segments":2,"active":false},...], oldest first.
+// A recording shows up once its first segment is closed.
+size_t formatRecordings(char *dest, size_t size)
+{
+  RecordingInfo list[MAX_RECORDINGS];
+  uint32_t total;
+  int count = 0;
+  if (timeshiftReady)
+  {
+    xSemaphoreTake(spillLock, portMAX_DELAY);
+    count = readRecordings(list, MAX_RECORDINGS, &total);
+    xSemaphoreGive(spillLock);
+  }
+  size_t len = snprintf(dest, size, "[");
+  for (int i = 0; i < count && len < size; i++)
+    len += snprintf(dest + len, size - len, "%s{\"id\":%u,\"bytes\":%u,\"segments\":%u,\"active\":%s}",
+                    i ? "," : "", (unsigned)list[i].id, (unsigned)list[i].bytes, (unsigned)list[i].segments,
+                    list[i].id == activeRecordingId ? "true" : "false");
+  if (len < size)
+    len += snprintf(dest + len, size - len, "]");
+  return min(len, size - 1);
+}
+
+bool timeshiftDeleteRecording(uint32_t id)
+{
+  if (!timeshiftReady)
+    return false;
+  xSemaphoreTake(spillLock, portMAX_DELAY);
+  bool removed = removeRecording(id);
+  xSemaphoreGive(spillLock);
+  return removed;
+}
+
+// Download state for one recording: its segments in order and the one open
+struct RecordingReader
+{
+  uint32_t ids[SPILL_MAX_SEGMENTS * 4];
+  uint32_t lengths[SPILL_MAX_SEGMENTS * 4];
+  int count = 0;
+  int segment = 0;
+  uint32_t segmentStart = 0; // download offset where `segment` begins
+  File file;
+};
+
+// nullptr if the recording has no closed segments
+RecordingReader *openRecording(uint32_t id, size_t *total)
+{
+  if (!timeshiftReady || id == activeRecordingId)
+    return nullptr;
+  RecordingReader *reader = new RecordingReader();
+  *total = 0;
+  xSemaphoreTake(spillLock, portMAX_DELAY);
+  File index = LittleFS.open(SPILL_INDEX_PATH, FILE_READ);
+  SpillSegment segment;
+  while (index && reader->count < SPILL_MAX_SEGMENTS * 4 &&
+         index.read((uint8_t *)&segment, sizeof(segment)) == sizeof(segment))
+  {
+    if (!(segment.flags & SPILL_SEGMENT_RECORDED) || segmentRecordingId(segment) != id)
+      continue;
+    reader->ids[reader->count] = segment.id;
+    reader->lengths[reader->count++] = segment.length;
+    *total += segment.length;
+  }
+  index.close();
+  xSemaphoreGive(spillLock);
+  if (reader->count == 0)
+  {
+    delete reader;
+    return nullptr;
+  }
+  return reader;
+}
+
+// Response filler: offsets only ever grow, so segments are opened in turn
+size_t readRecording(RecordingReader *reader, uint8_t *buffer, size_t maxLen, size_t offset)
+{
+  while (reader->segment < reader->count && offset >= reader->segmentStart + reader->lengths[reader->segment])
+  {
+    reader->segmentStart += reader->lengths[reader->segment++];
+    reader->file.close();
+  }
+  if (reader->segment >= reader->count)
+    return 0;
+  if (!reader->file)
+  {
+    char path[32];
+    spillPath(path, sizeof(path), reader->ids[reader->segment]);
+    reader->file = LittleFS.open(path, FILE_READ);
+    if (!reader->file)
+      return 0;
+  }
+  uint32_t into = offset - reader->segmentStart;
+  if (reader->file.position() != into && !reader->file.seek(into))
+    return 0;
+  return reader->file.read(buffer, min(maxLen, (size_t)(reader->lengths[reader->segment] - into)));
+}
+
+void closeRecording(RecordingReader *reader)
+{
+  reader->file.close();
+  delete reader;
+}
@@ -0,0 +1,400 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Client.h>
+#include <esp_heap_caps.h>
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include <mbedtls/version.h>
+#include <mbedtls/platform.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include "metrics.h"
+
+// TLS client for the stream tap that remembers sessions per host. A station
+// change or reconnect to a host seen before offers the saved session
+// (ticket or ID) and, if the server accepts it, skips the certificate
+// exchange and key agreement that make a full handshake so expensive.
+
+#define TLS_SESSION_CACHE_SIZE 4
+#define TLS_SESSION_BLOB_SIZE 2048
+#define TLS_STREAM_READ_TIMEOUT_MS 50
+#define TLS_CONNECT_POLL_MS 100
+
+// Session fields are private from mbedtls 3 on, and only 3.4 added getters
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define TLS_FIELD(name) MBEDTLS_PRIVATE(name)
+#else
+#define TLS_FIELD(name) name
+#endif
+
+struct TlsSessionEntry
+{
+  char host[64];
+  uint32_t lastUsed;
+  size_t length;
+  uint8_t blob[TLS_SESSION_BLOB_SIZE]; // mbedtls_ssl_session_save() output
+};
+
+TlsSessionEntry *tlsSessionCache = nullptr; // in PSRAM
+
+mbedtls_entropy_context tlsEntropy;
+mbedtls_ctr_drbg_context tlsDrbg;
+bool tlsReady = false;
+
+volatile uint32_t tlsHandshakes = 0;
+volatile uint32_t tlsResumed = 0;
+volatile uint32_t tlsHandshakeMsLast = 0;
+volatile uint32_t tlsInternalHeapLast = 0; // internal RAM held by the connection after its handshake
+volatile uint32_t tlsPsramLast = 0;
+
+#if defined(MBEDTLS_PLATFORM_MEMORY) && !defined(MBEDTLS_PLATFORM_CALLOC_MACRO)
+void *tlsCalloc(size_t n, size_t size)
+{
+  void *p = heap_caps_calloc(n, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  return p ? p : calloc(n, size);
+}
+#endif
+
+void setupTls()
+{
+  tlsSessionCache = (TlsSessionEntry *)ps_calloc(TLS_SESSION_CACHE_SIZE, sizeof(TlsSessionEntry));
+  mbedtls_entropy_init(&tlsEntropy);
+  mbedtls_ctr_drbg_init(&tlsDrbg);
+  tlsReady = tlsSessionCache &&
+             mbedtls_ctr_drbg_seed(&tlsDrbg, mbedtls_entropy_func, &tlsEntropy, (const unsigned char *)"aradio", 6) == 0;
+
+  // The 2 x 16 KiB record buffers go to PSRAM instead of internal RAM.
+  // mbedtls has a single process-wide allocator, so this cannot be scoped
+  // to the tap: every mbedtls user allocates through tlsCalloc from here
+  // on. That includes audio's own HTTPS streams, the WiFiClientSecure logo
+  // fetches in metadata.h, OTA and WiFiManager. That is intended. Their
+  // buffers are not touched by DMA, tlsCalloc falls back to internal RAM
+  // when PSRAM is full, and free() releases memory from either heap, so
+  // contexts allocated before this call are still freed correctly.
+#if CONFIG_MBEDTLS_EXTERNAL_MEM_ALLOC
+  // already configured that way
+#elif defined(MBEDTLS_PLATFORM_MEMORY) && !defined(MBEDTLS_PLATFORM_CALLOC_MACRO)
+  mbedtls_platform_set_calloc_free(tlsCalloc, free);
+#else
+  log_w("mbedtls allocator is fixed, TLS buffers stay in internal RAM");
+#endif
+
+  registerMetric("tls_handshakes", &tlsHandshakes);
+  registerMetric("tls_resumed", &tlsResumed);
+  registerMetric("tls_handshake_ms_last", &tlsHandshakeMsLast);
+  registerMetric("tls_internal_heap_last", &tlsInternalHeapLast);
+  registerMetric("tls_psram_last", &tlsPsramLast);
+}
+
+TlsSessionEntry *findTlsSession(const char *host)
+{
+  if (!tlsSessionCache)
+    return nullptr;
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++)
+    if (tlsSessionCache[i].length && strcmp(tlsSessionCache[i].host, host) == 0)
+      return &tlsSessionCache[i];
+  return nullptr;
+}
+
+void saveTlsSession(const char *host, mbedtls_ssl_context *ssl)
+{
+  if (!tlsSessionCache)
+    return;
+  TlsSessionEntry *entry = findTlsSession(host);
+  if (!entry)
+  {
+    entry = &tlsSessionCache[0];
+    for (int i = 1; i < TLS_SESSION_CACHE_SIZE; i++)
+      if (tlsSessionCache[i].lastUsed < entry->lastUsed)
+        entry = &tlsSessionCache[i];
+  }
+
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  size_t length = 0;
+  if (mbedtls_ssl_get_session(ssl, &session) == 0 &&
+      mbedtls_ssl_session_save(&session, entry->blob, sizeof(entry->blob), &length) == 0)
+  {
+    strlcpy(entry->host, host, sizeof(entry->host));
+    entry->length = length;
+    entry->lastUsed = millis();
+  }
+  mbedtls_ssl_session_free(&session);
+}
+
+// Session ID as the peer sees it
+size_t tlsSessionId(const mbedtls_ssl_session *session, const unsigned char **id)
+{
+  *id = session->TLS_FIELD(id);
+  return session->TLS_FIELD(id_len);
+}
+
+class TlsStreamClient : public Client
+{
+public:
+  int connect(IPAddress ip, uint16_t port) override
+  {
+    return connect(ip.toString().c_str(), port);
+  }
+
+  int connect(const char *host, uint16_t port) override
+  {
+    stop();
+    if (!tlsReady)
+      return 0;
+
+    uint32_t start = millis();
+    size_t internalBefore = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t psramBefore = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+
+    mbedtls_net_init(&_net);
+    mbedtls_ssl_init(&_ssl);
+    mbedtls_ssl_config_init(&_conf);
+    _initialized = true;
+
+    _net.fd = openSocket(host, port);
+    if (_net.fd < 0)
+      return fail("connect");
+    if (mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+      return fail("config");
+    // Same policy as audio's setInsecure() streams
+    mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &tlsDrbg);
+    mbedtls_ssl_conf_read_timeout(&_conf, _timeout);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    if (mbedtls_ssl_setup(&_ssl, &_conf) != 0 || mbedtls_ssl_set_hostname(&_ssl, host) != 0)
+      return fail("setup");
+    mbedtls_ssl_set_bio(&_ssl, &_net, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+
+    bool offered = false;
+    TlsSessionEntry *cached = findTlsSession(host);
+    if (cached)
+    {
+      mbedtls_ssl_session session;
+      mbedtls_ssl_session_init(&session);
+      offered = mbedtls_ssl_session_load(&session, cached->blob, cached->length) == 0 &&
+                mbedtls_ssl_set_session(&_ssl, &session) == 0;
+      mbedtls_ssl_session_free(&session);
+    }
+
+    // Step through the ClientHello first: with a ticket mbedtls offers a
+    // fresh random session ID rather than the cached one, so the ID to
+    // compare against is only known once the hello is written
+    unsigned char offeredId[32];
+    size_t offeredIdLen = 0;
+    int ret = 0;
+    while (ret == 0 && _ssl.TLS_FIELD(state) <= MBEDTLS_SSL_CLIENT_HELLO)
+      ret = mbedtls_ssl_handshake_step(&_ssl);
+    if (ret == 0 && offered)
+    {
+      const unsigned char *id;
+      offeredIdLen = min(tlsSessionId(_ssl.TLS_FIELD(session_negotiate), &id), sizeof(offeredId));
+      memcpy(offeredId, id, offeredIdLen);
+    }
+
+    if (ret == 0)
+    {
+      while ((ret = mbedtls_ssl_handshake(&_ssl)) == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+        ;
+    }
+    if (ret != 0)
+    {
+      // A stale session is a common cause, forget it
+      if (cached)
+        cached->length = 0;
+      return fail("handshake");
+    }
+
+    // Servers echo the offered ID when they accept an ID or a ticket, and
+    // pick a new one for a full handshake
+    bool resumed = false;
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    if (offeredIdLen && mbedtls_ssl_get_session(&_ssl, &session) == 0)
+    {
+      const unsigned char *id;
+      resumed = tlsSessionId(&session, &id) == offeredIdLen && memcmp(id, offeredId, offeredIdLen) == 0;
+    }
+    mbedtls_ssl_session_free(&session);
+    saveTlsSession(host, &_ssl);
+    mbedtls_ssl_conf_read_timeout(&_conf, TLS_STREAM_READ_TIMEOUT_MS);
+
+    tlsHandshakes++;
+    if (resumed)
+      tlsResumed++;
+    tlsHandshakeMsLast = millis() - start;
+    tlsInternalHeapLast = internalBefore - heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    tlsPsramLast = psramBefore - heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    Serial.printf("tls         %s %s handshake %u ms, %u B internal, %u B PSRAM\n", host,
+                  resumed ? "resumed" : "full", (unsigned)tlsHandshakeMsLast,
+                  (unsigned)tlsInternalHeapLast, (unsigned)tlsPsramLast);
+
+    _connected = true;
+    return 1;
+  }
+
+  size_t write(uint8_t b) override
+  {
+    return write(&b, 1);
+  }
+
+  size_t write(const uint8_t *buf, size_t size) override
+  {
+    size_t sent = 0;
+    while (_connected && sent < size)
+    {
+      int ret = mbedtls_ssl_write(&_ssl, buf + sent, size - sent);
+      if (ret > 0)
+        sent += ret;
+      else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+        _connected = false;
+    }
+    return sent;
+  }
+
+  int available() override
+  {
+    return _connected ? mbedtls_ssl_get_bytes_avail(&_ssl) : 0;
+  }
+
+  int read() override
+  {
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+  }
+
+  // Returns -1 when nothing arrived within TLS_STREAM_READ_TIMEOUT_MS
+  int read(uint8_t *buf, size_t size) override
+  {
+    if (!_connected)
+      return -1;
+    int ret = mbedtls_ssl_read(&_ssl, buf, size);
+    if (ret > 0)
+      return ret;
+    if (ret != MBEDTLS_ERR_SSL_TIMEOUT && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+      _connected = false;
+    return -1;
+  }
+
+  int peek() override
+  {
+    return -1;
+  }
+
+  void flush() override
+  {
+  }
+
+  void stop() override
+  {
+    if (!_initialized)
+      return;
+    if (_connected)
+      mbedtls_ssl_close_notify(&_ssl);
+    mbedtls_ssl_free(&_ssl);
+    mbedtls_ssl_config_free(&_conf);
+    mbedtls_net_free(&_net);
+    _initialized = false;
+    _connected = false;
+  }
+
+  uint8_t connected() override
+  {
+    return _connected;
+  }
+
+  operator bool() override
+  {
+    return _connected;
+  }
+
+  // connect() gives up early once *abort turns true
+  void setAbortFlag(const volatile bool *abort)
+  {
+    _abort = abort;
+  }
+
+  void setHandshakeTimeout(uint32_t timeoutMs)
+  {
+    _timeout = timeoutMs;
+  }
+
+private:
+  // mbedtls_net_connect() blocks for the whole TCP SYN timeout when a host
+  // is black-holed, and the tap task with it. Connect non-blocking instead
+  // and give up at the handshake deadline. Returns the socket or -1.
+  int openSocket(const char *host, uint16_t port)
+  {
+    struct addrinfo hints = {};
+    struct addrinfo *addrs = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    char portStr[8];
+    snprintf(portStr, sizeof(portStr), "%u", port);
+    if (getaddrinfo(host, portStr, &hints, &addrs) != 0 || !addrs)
+      return -1;
+
+    int fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+    if (fd < 0)
+    {
+      freeaddrinfo(addrs);
+      return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    int ret = ::connect(fd, addrs->ai_addr, addrs->ai_addrlen);
+    freeaddrinfo(addrs);
+    if (ret != 0 && errno != EINPROGRESS)
+    {
+      close(fd);
+      return -1;
+    }
+
+    uint32_t start = millis();
+    while (ret != 0)
+    {
+      if (millis() - start >= _timeout || (_abort && *_abort))
+      {
+        close(fd);
+        return -1;
+      }
+      fd_set writable;
+      FD_ZERO(&writable);
+      FD_SET(fd, &writable);
+      struct timeval poll = {0, TLS_CONNECT_POLL_MS * 1000};
+      int n = select(fd + 1, nullptr, &writable, nullptr, &poll);
+      int error = 0;
+      socklen_t length = sizeof(error);
+      if (n < 0 || (n > 0 && (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)))
+      {
+        close(fd);
+        return -1;
+      }
+      if (n > 0)
+        ret = 0;
+    }
+    // Reads and writes go through mbedtls_net_recv_timeout() from here on
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    return fd;
+  }
+
+  int fail(const char *step)
+  {
+    log_e("TLS %s failed", step);
+    stop();
+    return 0;
+  }
+
+  mbedtls_net_context _net;
+  mbedtls_ssl_context _ssl;
+  mbedtls_ssl_config _conf;
+  bool _initialized = false;
+  bool _connected = false;
+  uint32_t _timeout = 5000;
+  const volatile bool *_abort = nullptr;
+};
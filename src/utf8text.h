@@ -0,0 +1,282 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Station names and titles arrive as UTF-8, or as Latin-1 from older
+// servers. They are cleaned once when they arrive, into valid UTF-8 that is
+// cut only between code points. Each display then turns that into one byte
+// per glyph for the built-in 5x7 font, which draws code page 437 once
+// cp437(true) is set. Characters CP437 lacks are transliterated, and
+// anything else becomes '?'. Everything writes into caller-owned buffers.
+// No Arduino headers and no allocation.
+
+#define UTF8_TRUNCATED 0xFFFFFFFF
+
+// Second byte ranges that rule out overlong forms, surrogates and values
+// past U+10FFFF as early as possible
+bool utf8SecondByteValid(uint8_t lead, uint8_t second)
+{
+  if (lead == 0xE0)
+    return second >= 0xA0 && second <= 0xBF;
+  if (lead == 0xED)
+    return second >= 0x80 && second <= 0x9F;
+  if (lead == 0xF0)
+    return second >= 0x90 && second <= 0xBF;
+  if (lead == 0xF4)
+    return second >= 0x80 && second <= 0x8F;
+  return (second & 0xC0) == 0x80;
+}
+
+// Decodes one code point from s (len bytes available, len > 0) and returns
+// the bytes consumed. A byte that does not start a valid sequence is read
+// as Latin-1, so is a lone lead byte at the very end ("Beyonc\xe9"). A
+// valid prefix of two or more bytes that runs into the end of the input
+// returns UTF8_TRUNCATED, so callers can drop what a previous cut left behind.
+size_t utf8Decode(const char *s, size_t len, uint32_t *cp)
+{
+  const uint8_t *p = (const uint8_t *)s;
+  uint8_t lead = p[0];
+  if (lead < 0x80)
+  {
+    *cp = lead;
+    return 1;
+  }
+
+  size_t need;
+  uint32_t value, min;
+  if (lead >= 0xC2 && lead <= 0xDF)
+  {
+    need = 1;
+    value = lead & 0x1F;
+    min = 0x80;
+  }
+  else if (lead >= 0xE0 && lead <= 0xEF)
+  {
+    need = 2;
+    value = lead & 0x0F;
+    min = 0x800;
+  }
+  else if (lead >= 0xF0 && lead <= 0xF4)
+  {
+    need = 3;
+    value = lead & 0x07;
+    min = 0x10000;
+  }
+  else
+  {
+    *cp = lead;
+    return 1;
+  }
+
+  for (size_t i = 1; i <= need; i++)
+  {
+    if (i >= len)
+    {
+      *cp = i >= 2 ? UTF8_TRUNCATED : lead;
+      return i >= 2 ? len : 1;
+    }
+    bool valid = i == 1 ? utf8SecondByteValid(lead, p[1]) : (p[i] & 0xC0) == 0x80;
+    if (!valid)
+    {
+      *cp = lead;
+      return 1;
+    }
+    value = (value << 6) | (p[i] & 0x3F);
+  }
+
+  // Overlong forms, surrogates and values past U+10FFFF are not UTF-8
+  if (value < min || (value >= 0xD800 && value <= 0xDFFF) || value > 0x10FFFF)
+  {
+    *cp = lead;
+    return 1;
+  }
+  *cp = value;
+  return need + 1;
+}
+
+size_t utf8Encode(uint32_t cp, char *out)
+{
+  if (cp < 0x80)
+  {
+    out[0] = (char)cp;
+    return 1;
+  }
+  if (cp < 0x800)
+  {
+    out[0] = (char)(0xC0 | (cp >> 6));
+    out[1] = (char)(0x80 | (cp & 0x3F));
+    return 2;
+  }
+  if (cp < 0x10000)
+  {
+    out[0] = (char)(0xE0 | (cp >> 12));
+    out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[2] = (char)(0x80 | (cp & 0x3F));
+    return 3;
+  }
+  out[0] = (char)(0xF0 | (cp >> 18));
+  out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+  out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+  out[3] = (char)(0x80 | (cp & 0x3F));
+  return 4;
+}
+
+// Copies src into dest as valid UTF-8, stopping before the first code point
+// that does not fit. Control characters become spaces. Returns the length.
+size_t utf8Copy(char *dest, size_t size, const char *src)
+{
+  if (size == 0)
+    return 0;
+  size_t len = 0;
+  size_t remaining = strlen(src);
+  while (remaining > 0)
+  {
+    uint32_t cp;
+    size_t used = utf8Decode(src, remaining, &cp);
+    src += used;
+    remaining -= used;
+    if (cp == UTF8_TRUNCATED)
+      break;
+    if (cp < 0x20 || cp == 0x7F)
+      cp = ' ';
+
+    char encoded[4];
+    size_t n = utf8Encode(cp, encoded);
+    if (len + n >= size)
+      break;
+    memcpy(dest + len, encoded, n);
+    len += n;
+  }
+  dest[len] = '\0';
+  return len;
+}
+
+// CP437 glyph for U+00A0..U+00FF, 0 where the code page has none
+static const uint8_t latin1ToCp437[96] = {
+    0xFF, 0xAD, 0x9B, 0x9C, 0, 0x9D, 0, 0, 0, 0, 0xA6, 0xAE, 0xAA, 0, 0, 0,
+    0xF8, 0xF1, 0xFD, 0, 0, 0xE6, 0, 0xFA, 0, 0, 0xA7, 0xAF, 0xAC, 0xAB, 0, 0xA8,
+    0, 0, 0, 0, 0x8E, 0x8F, 0x92, 0x80, 0, 0x90, 0, 0, 0, 0, 0, 0,
+    0, 0xA5, 0, 0, 0, 0, 0x99, 0, 0, 0, 0, 0, 0x9A, 0, 0, 0xE1,
+    0x85, 0xA0, 0x83, 0, 0x84, 0x86, 0x91, 0x87, 0x8A, 0x82, 0x88, 0x89, 0x8D, 0xA1, 0x8C, 0x8B,
+    0, 0xA4, 0x95, 0xA2, 0x93, 0, 0x94, 0xF6, 0, 0x97, 0xA3, 0x96, 0x81, 0, 0, 0x98,
+};
+
+// Base letter for U+00C0..U+017F; '?' marks the ones spelled out below
+static const char latinBase[] =
+    "AAAAAA?CEEEEIIIIDNOOOOOxOUUUUY??aaaaaa?ceeeeiiiidnooooo/ouuuuy?y"
+    "AaAaAaCcCcCcCcDdDdEeEeEeEeEeGgGgGgGgHhHhIiIiIiIiIiIiJjKkkLlLlLlL"
+    "lLlNnNnNnnNnOoOoOo??RrRrRrSsSsSsSsTtTtTtUuUuUuUuUuUuWwYyYZzZzZzs";
+
+// ASCII spelling of a code point CP437 cannot draw, or nullptr
+const char *transliterate(uint32_t cp, char letter[2])
+{
+  switch (cp)
+  {
+  case 0xA9:
+    return "(c)";
+  case 0xAE:
+    return "(R)";
+  case 0xB4:
+  case 0x2018:
+  case 0x2019:
+  case 0x201A:
+  case 0x2032:
+    return "'";
+  case 0x201C:
+  case 0x201D:
+  case 0x201E:
+  case 0x2033:
+    return "\"";
+  case 0x2010:
+  case 0x2011:
+  case 0x2012:
+  case 0x2013:
+  case 0x2014:
+  case 0x2212:
+    return "-";
+  case 0x2022:
+    return "*";
+  case 0x2026:
+    return "...";
+  case 0x20AC:
+    return "EUR";
+  case 0xC6:
+    return "AE";
+  case 0xE6:
+    return "ae";
+  case 0xDE:
+    return "Th";
+  case 0xFE:
+    return "th";
+  case 0xDF:
+    return "ss";
+  case 0x132:
+    return "IJ";
+  case 0x133:
+    return "ij";
+  case 0x152:
+    return "OE";
+  case 0x153:
+    return "oe";
+  }
+  if ((cp >= 0x2000 && cp <= 0x200A) || cp == 0x202F || cp == 0x3000)
+    return " ";
+  if (cp >= 0xC0 && cp <= 0x17F)
+  {
+    letter[0] = latinBase[cp - 0xC0];
+    letter[1] = '\0';
+    return letter[0] == '?' ? nullptr : letter;
+  }
+  return nullptr;
+}
+
+// Zero-width characters and combining accents draw nothing on their own
+bool zeroWidth(uint32_t cp)
+{
+  return (cp >= 0x300 && cp <= 0x36F) || (cp >= 0x200B && cp <= 0x200F) || cp == 0xFEFF;
+}
+
+// Converts UTF-8 text into one glyph byte per character for the 5x7 font.
+// Stops before a character whose glyphs do not all fit. Returns the length.
+size_t displayText(char *dest, size_t size, const char *src)
+{
+  if (size == 0)
+    return 0;
+  size_t len = 0;
+  size_t remaining = strlen(src);
+  while (remaining > 0)
+  {
+    uint32_t cp;
+    size_t used = utf8Decode(src, remaining, &cp);
+    src += used;
+    remaining -= used;
+    if (cp == UTF8_TRUNCATED)
+      break;
+    if (zeroWidth(cp))
+      continue;
+
+    char glyph = '?', letter[2];
+    const char *spelled = nullptr;
+    if (cp >= 0x20 && cp < 0x7F)
+      glyph = (char)cp;
+    else if (cp < 0x20 || cp == 0x7F)
+      glyph = ' ';
+    else if (cp >= 0xA0 && cp <= 0xFF && latin1ToCp437[cp - 0xA0])
+      glyph = (char)latin1ToCp437[cp - 0xA0];
+    else
+      spelled = transliterate(cp, letter);
+
+    size_t n = spelled ? strlen(spelled) : 1;
+    if (len + n >= size)
+      break;
+    if (spelled)
+      memcpy(dest + len, spelled, n);
+    else
+      dest[len] = glyph;
+    len += n;
+  }
+  dest[len] = '\0';
+  return len;
+}
@@ -1,7 +1,30 @@
 #pragma once
 #include <ESPAsyncWebServer.h>
 #include "Audio.h"
+#include "config.h"
 #include "epromAddreses.h"
+#include "metrics.h"
+#include "power.h"
+#include "streamtap.h"
+#include "timeshift.h"
+#if ARADIO_MULTIROOM
+#include "multiroom.h"
+#else
+// Compiled out: never following a leader, never holding audio back
+bool multiroomFollowing() { return false; }
+bool multiroomHoldAudio() { return false; }
+#endif
+#include "listen.h"
+#include "responsepool.h"
+#include "ratelimit.h"
+#include "control.h"
+#include "scheduler.h"
+#include "metadata.h"
+#if ARADIO_BENCHMARK
+#include "benchmark.h"
+#endif
+
+static_assert(RESPONSE_LARGE_SLOT_SIZE >= HISTORY_SIZE * 512, "/history body does not fit a large response slot");
 
 AsyncWebServer server(80);
 extern Audio audio;
@@ -35,15 +58,27 @@ auto escape_csv = [](const char *src, char *dest, size_t destSize)
 
 inline void setupWebServer()
 {
+  registerSystemMetrics();
+  setupResponsePool();
+  setupRateLimit();
+  setupControl();
+
+  // Any request wakes the device from idle before its handler runs
+  server.addMiddleware([](AsyncWebServerRequest *request, ArMiddlewareNext next)
+                       {
+      powerWake();
+      if (!rateLimitAllow(request->client()->remoteIP(), request->url().c_str()))
+      {
+        sendText(request, 429, "Too many requests");
+        return;
+      }
+      next(); });
 
   server.onNotFound([](AsyncWebServerRequest *request)
-                    {
-      AsyncWebServerResponse *resp = request->beginResponse(404, "text/plain", "Not found");
-      resp->addHeader("Access-Control-Allow-Origin", "*");
-      request->send(resp); });
+                    { sendText(request, 404, "Not found"); });
 
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
-            { request->send(200, "text/html", htmlPage); });
+            { request->send(request->beginResponse(200, "text/html", (const uint8_t *)htmlPage, strlen(htmlPage))); });
   server.on("/status", HTTP_GET, [](AsyncWebServerRequest *request)
             { 
                 int volume = audio.getVolume();
@@ -54,100 +89,348 @@ inline void setupWebServer()
                 escape_csv(stationName, escStationName, sizeof(escStationName));
                 escape_csv(stationTitle, escStationTitle, sizeof(escStationTitle));
 
-                char response[1050];
-                snprintf(response, sizeof(response), "%d,%d,%s,%s", isRunning ,volume, escStationName, escStationTitle);
+                sendText(request, 200, "%d,%d,%s,%s", isRunning, volume, escStationName, escStationTitle); });
+
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+                ResponseSlot *slot = acquireResponseSlot(request);
+                if (!slot)
+                {
+                  request->send(503, "text/plain", "Busy");
+                  return;
+                }
+                updateSystemMetrics();
+                size_t len = formatMetrics(slot->body, sizeof(slot->body));
+                sendSlot(request, 200, "text/plain", slot, len); });
 
-                AsyncWebServerResponse *resp = request->beginResponse(200, "text/plain", response);
-                resp->addHeader("Access-Control-Allow-Origin", "*");
-                request->send(resp); });
+#if ARADIO_BENCHMARK
+  server.on("/benchmark", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+                ResponseSlot *slot = acquireResponseSlot(request);
+                if (!slot)
+                {
+                  request->send(503, "text/plain", "Busy");
+                  return;
+                }
+                size_t len = formatBenchmark(slot->body, sizeof(slot->body));
+                sendSlot(request, 200, "text/plain", slot, len); });
+#endif
 
   server.on("/play", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-              stationName[0] = '\0';
-              stationTitle[0] = '\0';
-              int code = 200;
-              String responseBody = "ok";
-              if (request->hasParam("url"))
+              if (multiroomFollowing())
               {
-                String streamURL = request->getParam("url")->value();
-                if (audio.isRunning())
+                sendText(request, 409, "Following a multi-room leader");
+              }
+              else if (request->hasParam("url"))
+              {
+                stationName[0] = '\0';
+                stationTitle[0] = '\0';
+                const String &streamURL = request->getParam("url")->value();
+                setPlayLogo(request->hasParam("logo") ? request->getParam("logo")->value().c_str() : "");
+                queuePlay(streamURL.c_str());
+                sendText(request, 202, "Playing: %s", streamURL.c_str());
+              }
+              else
+              {
+                sendText(request, 400, "Missing 'url' parameter");
+              } });
+
+  server.on("/stop", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              if (!queueStop())
+              {
+                sendText(request, 400, "Not playing any stream");
+              }
+              else
+              {
+                stationName[0] = '\0';
+                stationTitle[0] = '\0';
+                sendText(request, 202, "Stopping stream");
+              } });
+
+  // Pause, resume and seek are checked here and carried out by controlLoop()
+  server.on("/pause", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              if (!tapActive() || timeshiftPaused)
+                sendText(request, 400, "Nothing to pause");
+              else
+              {
+                queueTimeshift(TIMESHIFT_PAUSE);
+                sendText(request, 202, "Pausing");
+              } });
+
+  server.on("/resume", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              if (!timeshiftPaused)
+                sendText(request, 400, "Not paused");
+              else
+              {
+                queueTimeshift(TIMESHIFT_RESUME);
+                sendText(request, 202, "Resuming %u s behind live", (unsigned)timeshiftBehindSeconds());
+              } });
+
+  server.on("/seek", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              if (request->hasParam("offset"))
+              {
+                int offset = request->getParam("offset")->value().toInt();
+                if (offset < 0)
+                  sendText(request, 400, "Offset is seconds behind live and must be >= 0");
+                else if (!tapActive())
+                  sendText(request, 400, "Timeshift not available for this stream");
+                else
                 {
-                  audio.stopSong();
-                  while (audio.isRunning()) {
-                     vTaskDelay(10);
-                  }
+                  queueTimeshift(TIMESHIFT_SEEK, offset);
+                  sendText(request, 202, "Seeking to %d s behind live", offset);
                 }
-                delay(1000);
-                if (audio.connecttohost(streamURL.c_str()))
+              }
+              else
+              {
+                sendText(request, 400, "Missing 'offset' parameter");
+              } });
+
+  server.on("/record", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              bool enable = !recording;
+              if (request->hasParam("state"))
+                enable = request->getParam("state")->value() == "on";
+              if (timeshiftRecord(enable))
+                sendText(request, 200, enable ? "Recording" : "Recording stopped");
+              else
+                sendText(request, 400, "Recording not available for this stream"); });
+
+  server.on("/recordings", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+                ResponseSlot *slot = acquireResponseSlot(request);
+                if (!slot)
                 {
-                  code = 200;
-                  responseBody = "Playing: " + streamURL;
-                  EEPROM.writeString(LAST_URL_EPROM_ADDEESS, streamURL);
-                  EEPROM.commit();
+                  request->send(503, "text/plain", "Busy");
+                  return;
                 }
+                size_t len = formatRecordings(slot->body, sizeof(slot->body));
+                sendSlot(request, 200, "application/json", slot, len); });
+
+  // /recording?id=3 downloads the raw stream bytes, /recording?id=3&delete removes it
+  server.on("/recording", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              if (!request->hasParam("id"))
+              {
+                sendText(request, 400, "Missing 'id' parameter");
+                return;
+              }
+              uint32_t id = strtoul(request->getParam("id")->value().c_str(), NULL, 10);
+              if (request->hasParam("delete"))
+              {
+                if (timeshiftDeleteRecording(id))
+                  sendText(request, 200, "Recording %u deleted", (unsigned)id);
+                else
+                  sendText(request, 404, "No such recording, or it is still being written");
+                return;
+              }
+              size_t total;
+              RecordingReader *reader = openRecording(id, &total);
+              if (!reader)
+              {
+                sendText(request, 404, "No such recording, or it is still being written");
+                return;
+              }
+              request->onDisconnect([reader]()
+                                    { closeRecording(reader); });
+              AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", total,
+                                                                        [reader](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                                                        { return readRecording(reader, buffer, maxLen, index); });
+              char disposition[48];
+              snprintf(disposition, sizeof(disposition), "attachment; filename=\"recording-%u\"", (unsigned)id);
+              response->addHeader("Content-Disposition", disposition);
+              request->send(response); });
+
+  server.on("/listen", HTTP_GET, handleListen);
+
+#if ARADIO_MULTIROOM
+  server.on("/multiroom", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              if (request->hasParam("role"))
+              {
+                const String &role = request->getParam("role")->value();
+                uint32_t newRole = role == "leader" ? MULTIROOM_LEADER : role == "follower" ? MULTIROOM_FOLLOWER : MULTIROOM_OFF;
+                if ((newRole != MULTIROOM_OFF || role == "off") && setMultiroomRole(newRole))
+                  sendText(request, 202, "Multi-room role: %s", role.c_str());
+                else
+                  sendText(request, 400, "Role must be leader, follower or off");
+              }
+              else
+              {
+                sendText(request, 400, "Missing 'role' parameter");
+              } });
+#endif
+
+  server.on("/history", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              char etag[16];
+              snprintf(etag, sizeof(etag), "\"h%u\"", (unsigned)historyVersion);
+              if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == etag)
+              {
+                request->send(304);
+                return;
+              }
+              LargeResponseSlot *slot = acquireLargeResponseSlot(request);
+              if (!slot)
+              {
+                request->send(503, "text/plain", "Busy");
+                return;
+              }
+              size_t len = formatHistory(slot->body, RESPONSE_LARGE_SLOT_SIZE);
+              AsyncWebServerResponse *response = request->beginResponse(200, "application/json", (const uint8_t *)slot->body, len);
+              response->addHeader("ETag", etag);
+              response->addHeader("Cache-Control", "no-cache");
+              request->send(response); });
+
+  // Current station logo, or /logo?src=<url> for the logo of a recently
+  // played station: one not cached yet is fetched in the background, ask
+  // again after a 202
+  server.on("/logo", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              const char *src = request->hasParam("src") ? request->getParam("src")->value().c_str() : nullptr;
+              uint32_t key = src ? logoKey(src) : currentLogoKey;
+              if (src && !logoAllowed(key))
+              {
+                sendText(request, 403, "Not the logo of a recent station");
+                return;
+              }
+              char etag[16];
+              snprintf(etag, sizeof(etag), "\"%08x\"", (unsigned)key);
+              LogoState state;
+              LogoEntry *entry = key ? acquireLogo(key, &state) : nullptr;
+              if (!entry)
+              {
+                if (src && state == LOGO_EMPTY && logoCache)
+                {
+                  if (prefetchLogo(src))
+                    sendText(request, 202, "Logo is being fetched");
+                  else
+                    sendText(request, 503, "Logo queue full");
+                }
+                else if (key && state == LOGO_LOADING)
+                  sendText(request, 202, "Logo is being fetched");
                 else
+                  sendText(request, 404, "No logo");
+                return;
+              }
+              if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == etag)
+              {
+                releaseLogo(entry);
+                request->send(304);
+                return;
+              }
+              request->onDisconnect([entry]()
+                                    { releaseLogo(entry); });
+              AsyncWebServerResponse *response = request->beginResponse(200, "image/bmp", entry->bmp, LOGO_BMP_SIZE);
+              response->addHeader("ETag", etag);
+              // A src URL always maps to the same image, the current logo changes with the station
+              response->addHeader("Cache-Control", request->hasParam("src") ? "public, max-age=86400" : "no-cache");
+              request->send(response); });
+
+  server.on("/alarms", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+                ResponseSlot *slot = acquireResponseSlot(request);
+                if (!slot)
                 {
-                  code = 500;
-                  responseBody = "Failed to connect to: " + streamURL;
+                  request->send(503, "text/plain", "Busy");
+                  return;
                 }
+                size_t len = formatAlarms(slot->body, sizeof(slot->body));
+                sendSlot(request, 200, "text/plain", slot, len); });
+
+  // /alarm?slot=0&time=07:30&days=12345&volume=12&fade=30&url=...  or  /alarm?slot=0&off
+  server.on("/alarm", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              int slot = request->hasParam("slot") ? request->getParam("slot")->value().toInt() : -1;
+              if (slot < 0 || slot >= MAX_ALARMS)
+              {
+                sendText(request, 400, "Slot must be between 0 and %d", MAX_ALARMS - 1);
+                return;
               }
-              else
+              if (request->hasParam("off"))
+              {
+                clearAlarm(slot);
+                sendText(request, 200, "Alarm %d off", slot);
+                return;
+              }
+              int hour, minute;
+              if (!request->hasParam("time") || !request->hasParam("url") ||
+                  sscanf(request->getParam("time")->value().c_str(), "%d:%d", &hour, &minute) != 2 ||
+                  hour < 0 || hour > 23 || minute < 0 || minute > 59)
+              {
+                sendText(request, 400, "Need time=HH:MM and url");
+                return;
+              }
+              Alarm alarm = {};
+              alarm.magic = ALARM_MAGIC;
+              alarm.hour = hour;
+              alarm.minute = minute;
+              if (request->hasParam("days"))
+                for (const char *c = request->getParam("days")->value().c_str(); *c; c++)
+                  if (*c >= '0' && *c <= '6')
+                    alarm.days |= 1 << (*c - '0');
+              alarm.volume = request->hasParam("volume") ? constrain(request->getParam("volume")->value().toInt(), 1, 21) : 12;
+              alarm.fadeSeconds = request->hasParam("fade") ? constrain(request->getParam("fade")->value().toInt(), 0, 600) : 30;
+              const String &url = request->getParam("url")->value();
+              if (url.length() >= sizeof(alarm.url))
               {
-                code = 400;
-                responseBody = "Missing 'url' parameter";
+                sendText(request, 400, "URL too long");
+                return;
               }
-              AsyncWebServerResponse *resp = request->beginResponse(code, "text/plain", responseBody);
-              resp->addHeader("Access-Control-Allow-Origin", "*");
-              request->send(resp); });
+              strlcpy(alarm.url, url.c_str(), sizeof(alarm.url));
+              setAlarm(slot, alarm);
+              sendText(request, 200, "Alarm %d at %02d:%02d", slot, hour, minute); });
 
-  server.on("/stop", HTTP_GET, [](AsyncWebServerRequest *request)
+  // /sleep?minutes=30[&fade=60], minutes=0 cancels
+  server.on("/sleep", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-               stationName[0] = '\0';
-              stationTitle[0] = '\0';
-              int code = 200;
-              String responseBody = "";
-              if (!audio.isRunning())
+              if (!request->hasParam("minutes"))
+              {
+                sendText(request, 400, "Missing 'minutes' parameter");
+                return;
+              }
+              int minutes = request->getParam("minutes")->value().toInt();
+              int fade = request->hasParam("fade") ? request->getParam("fade")->value().toInt() : 60;
+              if (minutes < 0 || minutes > 720 || fade < 0)
               {
-                code = 400;
-                responseBody = "Not playing any stream";
+                sendText(request, 400, "Minutes must be between 0 and 720");
+                return;
               }
+              requestSleep(minutes, fade);
+              if (minutes == 0)
+                sendText(request, 200, "Sleep timer cancelled");
               else
+                sendText(request, 200, "Sleeping in %d min", minutes); });
+
+  // POSIX TZ string, e.g. tz=CET-1CEST,M3.5.0,M10.5.0/3
+  server.on("/timezone", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              if (!request->hasParam("tz") || request->getParam("tz")->value().length() >= sizeof(schedulerTZ))
               {
-                audio.stopSong();
-                EEPROM.writeString(LAST_URL_EPROM_ADDEESS, "");
-                EEPROM.commit();
-                code = 200;
-                responseBody = "Stream stopped";
+                sendText(request, 400, "Missing or too long 'tz' parameter");
+                return;
               }
-              AsyncWebServerResponse *resp = request->beginResponse(code, "text/plain", responseBody);
-              resp->addHeader("Access-Control-Allow-Origin", "*");
-              request->send(resp); });
+              setTimezone(request->getParam("tz")->value().c_str());
+              sendText(request, 200, "Timezone: %s", request->getParam("tz")->value().c_str()); });
 
   server.on("/setvolume", HTTP_GET, [](AsyncWebServerRequest *request)
             {
-              int code = 200;
-              String responseBody = "";
               if (request->hasParam("value")) {
-                String valueStr = request->getParam("value")->value();
-                int vol = valueStr.toInt();
+                int vol = request->getParam("value")->value().toInt();
                 if (vol >= 0 && vol <= 21) {
-                  audio.setVolume(vol);
-               
-                  EEPROM.writeInt(VOLUME_EPROM_ADDRESS, vol); 
-                  EEPROM.commit();
-                  code = 200;
-                  responseBody = "Volume set to " + String(vol);
+                  setVolumeDeferred(vol);
+                  sendText(request, 200, "Volume set to %d", vol);
                 } else {
-                  code = 400;
-                  responseBody = "Volume must be between 0 and 21";
+                  sendText(request, 400, "Volume must be between 0 and 21");
                 }
               } else {
-                code = 400;
-                responseBody = "Missing 'value' parameter";
-              } 
-              AsyncWebServerResponse *resp = request->beginResponse(code, "text/plain", responseBody);
-                resp->addHeader("Access-Control-Allow-Origin", "*");
-                request->send(resp); });
+                sendText(request, 400, "Missing 'value' parameter");
+              } });
 
+  setupListen();
   server.begin();
 }
@@ -0,0 +1,4 @@
+# Weekday alarm at 07:30 (0 = Sunday), fading in to volume 12 over 30 s
+curl "http://aradio.local/alarm?slot=0&time=07:30&days=12345&volume=12&fade=30&url=https%3A%2F%2Fshoutcast.ccma.cat%2Fccma%2FicatHD.mp3"
+curl http://aradio.local/alarms
+
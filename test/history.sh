@@ -0,0 +1,5 @@
+curl -i http://aradio.local/history
+# Second request with the returned ETag should answer 304 until a new title arrives
+ETAG=$(curl -sI http://aradio.local/history | tr -d '\r' | grep -i '^etag:' | cut -d' ' -f2)
+curl -i -H "If-None-Match: $ETAG" http://aradio.local/history
+
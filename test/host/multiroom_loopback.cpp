@@ -0,0 +1,228 @@
+// Runs the multi-room wire format and clock estimator as a leader and a
+// follower process talking over 127.0.0.1 UDP. The follower's clock is
+// skewed on purpose; the leader delays some sync replies before stamping
+// them so the estimator has asymmetric samples to reject.
+
+#include "../../src/multiroom_proto.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FOLLOWER_SKEW_US 123456789LL
+#define SYNC_EXCHANGES 16
+#define DATA_PACKETS 64
+#define BYTE_RATE 16000 // 128 kbps
+
+#define CHECK(cond)                                                                \
+  do                                                                               \
+  {                                                                                \
+    if (!(cond))                                                                   \
+    {                                                                              \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);     \
+      exit(1);                                                                     \
+    }                                                                              \
+  } while (0)
+
+int64_t monotonicUs()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t leaderNowUs() { return monotonicUs(); }
+int64_t followerNowUs() { return monotonicUs() + FOLLOWER_SKEW_US; }
+
+int openSocket(uint16_t *port)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  CHECK(fd >= 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+  socklen_t len = sizeof(addr);
+  CHECK(getsockname(fd, (sockaddr *)&addr, &len) == 0);
+  *port = ntohs(addr.sin_port);
+  timeval timeout = {2, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+void sendPacket(int fd, uint16_t port, MultiroomPacketType type, uint32_t generation, uint32_t offset,
+                int64_t leaderTimeUs, const void *payload, uint16_t length)
+{
+  uint8_t packet[sizeof(MultiroomHeader) + MULTIROOM_MAX_PAYLOAD];
+  MultiroomHeader header;
+  multiroomHeader(header, type, length, generation, offset, leaderTimeUs);
+  memcpy(packet, &header, sizeof(header));
+  if (length)
+    memcpy(packet + sizeof(header), payload, length);
+  sockaddr_in to = {};
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  to.sin_port = htons(port);
+  CHECK(sendto(fd, packet, sizeof(header) + length, 0, (sockaddr *)&to, sizeof(to)) == (ssize_t)(sizeof(header) + length));
+}
+
+uint8_t streamByte(uint32_t offset) { return (uint8_t)(offset * 31 + 7); }
+
+int runLeader(int syncFd, uint16_t followerDataPort)
+{
+  // Answer clock probes the way leaderStep() does
+  for (int i = 0; i < SYNC_EXCHANGES; i++)
+  {
+    uint8_t packet[sizeof(MultiroomHeader) + sizeof(MultiroomSync)];
+    sockaddr_in from = {};
+    socklen_t fromLen = sizeof(from);
+    ssize_t n = recvfrom(syncFd, packet, sizeof(packet), 0, (sockaddr *)&from, &fromLen);
+    CHECK(n > 0);
+    if (i % 2)
+      usleep(5000); // looks like 5 ms of extra delay on the way in
+    int64_t t2 = leaderNowUs();
+    const MultiroomHeader *header = multiroomParse(packet, n);
+    CHECK(header && header->type == MULTIROOM_SYNC_REQUEST && header->length == sizeof(MultiroomSync));
+    MultiroomSync sync;
+    memcpy(&sync, packet + sizeof(MultiroomHeader), sizeof(sync));
+    sync.t2 = t2;
+    sync.t3 = leaderNowUs();
+    sendPacket(syncFd, ntohs(from.sin_port), MULTIROOM_SYNC_RESPONSE, 0, 0, 0, &sync, sizeof(sync));
+  }
+
+  MultiroomAnnounce announce = {};
+  announce.bitrate = BYTE_RATE * 8;
+  strcpy(announce.contentType, "audio/mpeg");
+  strcpy(announce.stationName, "Loopback FM");
+  sendPacket(syncFd, followerDataPort, MULTIROOM_ANNOUNCE, 7, 0, leaderNowUs(), &announce, sizeof(announce));
+
+  uint8_t payload[MULTIROOM_MAX_PAYLOAD];
+  uint32_t offset = 1000;
+  for (int i = 0; i < DATA_PACKETS; i++)
+  {
+    uint16_t length = 100 + (i * 37) % (MULTIROOM_MAX_PAYLOAD - 100);
+    for (uint16_t j = 0; j < length; j++)
+      payload[j] = streamByte(offset + j);
+    sendPacket(syncFd, followerDataPort, MULTIROOM_DATA, 7, offset, leaderNowUs(), payload, length);
+    offset += length;
+    usleep(200);
+  }
+
+  // Garbage the follower must drop: wrong magic, then a length past the datagram
+  uint8_t junk[sizeof(MultiroomHeader)] = {};
+  sockaddr_in to = {};
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  to.sin_port = htons(followerDataPort);
+  sendto(syncFd, junk, sizeof(junk), 0, (sockaddr *)&to, sizeof(to));
+  MultiroomHeader lying;
+  multiroomHeader(lying, MULTIROOM_DATA, 500, 7, offset, leaderNowUs());
+  sendto(syncFd, &lying, sizeof(lying), 0, (sockaddr *)&to, sizeof(to));
+
+  sendPacket(syncFd, followerDataPort, MULTIROOM_POSITION, 7, offset, leaderNowUs(), nullptr, 0);
+  return 0;
+}
+
+int runFollower(int syncFd, int dataFd, uint16_t leaderSyncPort)
+{
+  ClockEstimator clock;
+  for (int i = 0; i < SYNC_EXCHANGES; i++)
+  {
+    MultiroomSync sync = {};
+    sync.t1 = followerNowUs();
+    sendPacket(syncFd, leaderSyncPort, MULTIROOM_SYNC_REQUEST, 0, 0, 0, &sync, sizeof(sync));
+    uint8_t packet[sizeof(MultiroomHeader) + sizeof(MultiroomSync)];
+    ssize_t n = recv(syncFd, packet, sizeof(packet), 0);
+    int64_t t4 = followerNowUs();
+    const MultiroomHeader *header = multiroomParse(packet, n);
+    CHECK(header && header->type == MULTIROOM_SYNC_RESPONSE && header->length == sizeof(MultiroomSync));
+    memcpy(&sync, packet + sizeof(MultiroomHeader), sizeof(sync));
+    clock.addSample(sync.t1, sync.t2, sync.t3, t4);
+  }
+  CHECK(clock.valid());
+  int64_t clockError = clock.offset() + FOLLOWER_SKEW_US;
+  printf("clock offset error %lld us, rtt %lld us\n", (long long)clockError, (long long)clock.rtt());
+  CHECK(llabs(clockError) < 1000);
+  CHECK(clock.rtt() >= 0 && clock.rtt() < 2000);
+
+  bool announced = false;
+  uint32_t expected = 1000;
+  int dataPackets = 0, rejected = 0;
+  for (;;)
+  {
+    uint8_t packet[sizeof(MultiroomHeader) + MULTIROOM_MAX_PAYLOAD];
+    ssize_t n = recv(dataFd, packet, sizeof(packet), 0);
+    CHECK(n > 0);
+    const MultiroomHeader *header = multiroomParse(packet, n);
+    if (!header)
+    {
+      rejected++;
+      continue;
+    }
+    CHECK(header->generation == 7);
+    const uint8_t *payload = packet + sizeof(MultiroomHeader);
+    if (header->type == MULTIROOM_ANNOUNCE)
+    {
+      MultiroomAnnounce announce;
+      CHECK(header->length == sizeof(announce));
+      memcpy(&announce, payload, sizeof(announce));
+      CHECK(strcmp(announce.stationName, "Loopback FM") == 0 && announce.bitrate == BYTE_RATE * 8);
+      announced = true;
+    }
+    else if (header->type == MULTIROOM_DATA)
+    {
+      CHECK(announced);
+      CHECK(header->offset == expected); // loopback keeps order
+      for (uint16_t j = 0; j < header->length; j++)
+        CHECK(payload[j] == streamByte(header->offset + j));
+      expected += header->length;
+      dataPackets++;
+    }
+    else if (header->type == MULTIROOM_POSITION)
+    {
+      CHECK(header->offset == expected);
+      // Playing exactly where the leader was, a little later: behind by that much
+      int64_t leaderNow = followerNowUs() + clock.offset();
+      int32_t error = multiroomErrorMs(header->offset, header->offset, header->leaderTimeUs, leaderNow, BYTE_RATE);
+      CHECK(error <= 0 && error > -50);
+      break;
+    }
+  }
+  printf("%d data packets, %u bytes, %d malformed rejected\n", dataPackets, (unsigned)(expected - 1000), rejected);
+  CHECK(dataPackets == DATA_PACKETS && rejected == 2);
+  return 0;
+}
+
+int main()
+{
+  // Error maths on its own, including offsets that wrap
+  CHECK(multiroomErrorMs(16000, 0, 0, 0, BYTE_RATE) == 1000);
+  CHECK(multiroomErrorMs(0, 16000, 0, 0, BYTE_RATE) == -1000);
+  CHECK(multiroomErrorMs(8000, 0, 0, 500000, BYTE_RATE) == 0);
+  CHECK(multiroomErrorMs(100, 0xFFFFFF9C, 0, 0, BYTE_RATE) == 12);
+  CHECK(multiroomErrorMs(1, 2, 0, 0, 0) == 0);
+
+  uint16_t leaderSyncPort, followerSyncPort, followerDataPort;
+  int leaderSync = openSocket(&leaderSyncPort);
+  int followerSync = openSocket(&followerSyncPort);
+  int followerData = openSocket(&followerDataPort);
+
+  pid_t leader = fork();
+  CHECK(leader >= 0);
+  if (leader == 0)
+    return runLeader(leaderSync, followerDataPort);
+
+  int result = runFollower(followerSync, followerData, leaderSyncPort);
+  int status;
+  waitpid(leader, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  if (result == 0)
+    puts("multiroom loopback ok");
+  return result;
+}
@@ -0,0 +1,125 @@
+// Takes, fills and releases response slots the way the route handlers do,
+// 100k times, and checks that none of it touches the heap. malloc and
+// friends are wrapped at link time (see the Makefile) and operator new is
+// replaced, so any allocation from the pool code is counted.
+
+#include "../../src/responseslots.h"
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 100000
+
+#define CHECK(cond)                                                                \
+  do                                                                               \
+  {                                                                                \
+    if (!(cond))                                                                   \
+    {                                                                              \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);     \
+      exit(1);                                                                     \
+    }                                                                              \
+  } while (0)
+
+static size_t allocations = 0;
+
+extern "C"
+{
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+
+  void *__wrap_malloc(size_t size)
+  {
+    allocations++;
+    return __real_malloc(size);
+  }
+
+  void *__wrap_calloc(size_t count, size_t size)
+  {
+    allocations++;
+    return __real_calloc(count, size);
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size)
+  {
+    allocations++;
+    return __real_realloc(ptr, size);
+  }
+}
+
+void *operator new(size_t size)
+{
+  allocations++;
+  void *ptr = __real_malloc(size);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+static size_t format(ResponseSlot *slot, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  size_t len = formatSlot(slot, format, args);
+  va_end(args);
+  return len;
+}
+
+static char largeBodies[RESPONSE_LARGE_SLOTS][RESPONSE_LARGE_SLOT_SIZE];
+
+int main()
+{
+  for (int i = 0; i < RESPONSE_LARGE_SLOTS; i++)
+    largeResponsePool[i].body = largeBodies[i];
+
+  // Exhaustion and reuse
+  ResponseSlot *taken[RESPONSE_POOL_SLOTS];
+  for (int i = 0; i < RESPONSE_POOL_SLOTS; i++)
+    CHECK((taken[i] = takeResponseSlot()) != nullptr);
+  CHECK(takeResponseSlot() == nullptr);
+  CHECK(responsePoolMisses == 1);
+  CHECK(responsePoolInUse == RESPONSE_POOL_SLOTS);
+  releaseResponseSlot(taken[2]);
+  CHECK(takeResponseSlot() == taken[2]);
+  for (int i = 0; i < RESPONSE_POOL_SLOTS; i++)
+    releaseResponseSlot(taken[i]);
+  CHECK(responsePoolInUse == 0);
+
+  // Bodies longer than a slot are cut, not overrun
+  static char big[RESPONSE_SLOT_SIZE * 2];
+  memset(big, 'x', sizeof(big) - 1);
+  ResponseSlot *slot = takeResponseSlot();
+  CHECK(format(slot, "%s", big) == RESPONSE_SLOT_SIZE - 1);
+  CHECK(slot->body[RESPONSE_SLOT_SIZE - 1] == '\0');
+  releaseResponseSlot(slot);
+
+  // The request burst: a few responses in flight at a time, like the UI
+  size_t before = allocations;
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    ResponseSlot *inFlight[4];
+    for (int i = 0; i < 4; i++)
+    {
+      inFlight[i] = takeResponseSlot();
+      CHECK(inFlight[i] != nullptr);
+      size_t len = format(inFlight[i], "%d,%d,%s,%s", round & 1, round % 22, "Station", "Artist - Title");
+      CHECK(len > 0 && len < RESPONSE_SLOT_SIZE);
+    }
+    LargeResponseSlot *large = takeLargeResponseSlot();
+    CHECK(large != nullptr);
+    snprintf(large->body, RESPONSE_LARGE_SLOT_SIZE, "[{\"time\":%d}]", round);
+    releaseLargeResponseSlot(large);
+    for (int i = 3; i >= 0; i--)
+      releaseResponseSlot(inFlight[i]);
+  }
+  CHECK(allocations == before);
+  CHECK(responsePoolInUse == 0);
+
+  printf("response pool ok, %d rounds, 0 allocations\n", ROUNDS);
+  return 0;
+}
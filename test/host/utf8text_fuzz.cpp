@@ -0,0 +1,246 @@
+// Feeds random byte strings, biased towards UTF-8 and Latin-1 fragments,
+// through utf8Copy and displayText and checks what every caller relies on:
+// nothing written past the buffer, always NUL-terminated, valid UTF-8 cut
+// on code points, idempotent, and no control bytes in the glyph output.
+// A few fixed cases pin down the Latin-1 fallback and transliteration.
+
+#include "../../src/utf8text.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ITERATIONS 200000
+#define MAX_INPUT 96
+#define CANARY 0xA5
+
+#define CHECK(cond)                                                                \
+  do                                                                               \
+  {                                                                                \
+    if (!(cond))                                                                   \
+    {                                                                              \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);     \
+      exit(1);                                                                     \
+    }                                                                              \
+  } while (0)
+
+static uint32_t rngState = 0x2545F491;
+
+static uint32_t nextRandom()
+{
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+// Strict validator written independently of utf8Decode
+static bool validUtf8(const uint8_t *s, size_t len)
+{
+  size_t i = 0;
+  while (i < len)
+  {
+    uint8_t b = s[i];
+    size_t need;
+    uint8_t lo = 0x80, hi = 0xBF;
+    if (b < 0x80)
+      need = 0;
+    else if (b >= 0xC2 && b <= 0xDF)
+      need = 1;
+    else if (b >= 0xE0 && b <= 0xEF)
+    {
+      need = 2;
+      if (b == 0xE0)
+        lo = 0xA0;
+      if (b == 0xED)
+        hi = 0x9F;
+    }
+    else if (b >= 0xF0 && b <= 0xF4)
+    {
+      need = 3;
+      if (b == 0xF0)
+        lo = 0x90;
+      if (b == 0xF4)
+        hi = 0x8F;
+    }
+    else
+      return false;
+    if (i + need >= len + (need ? 0 : 1))
+      return false;
+    for (size_t k = 1; k <= need; k++)
+    {
+      uint8_t c = s[i + k];
+      if (k == 1 ? (c < lo || c > hi) : (c & 0xC0) != 0x80)
+        return false;
+    }
+    i += need + 1;
+  }
+  return true;
+}
+
+static size_t randomInput(char *out)
+{
+  static const char *fragments[] = {
+      "\xc3\xa9", "\xe2\x80\x99", "\xf0\x9f\x8e\xb5", "\xe9", "\xf1", "\xc3",
+      "\xe2\x80", "\xf0\x9f", "\xed\xa0\x80", "\xc0\xaf", "\xe0\x80\xaf",
+      "\xf4\x90\x80\x80", "\xcc\x81", "\xef\xbb\xbf", "\x7f", "\t", "\xff"};
+  size_t count = sizeof(fragments) / sizeof(fragments[0]);
+  size_t len = 0, target = nextRandom() % MAX_INPUT;
+  while (len < target)
+  {
+    uint32_t r = nextRandom();
+    if (r % 3 == 0)
+    {
+      const char *f = fragments[(r >> 8) % count];
+      size_t n = strlen(f);
+      if (len + n > MAX_INPUT)
+        break;
+      memcpy(out + len, f, n);
+      len += n;
+    }
+    else
+    {
+      uint8_t b = (uint8_t)(r >> 8);
+      if (b == 0)
+        b = 'a';
+      out[len++] = (char)b;
+    }
+  }
+  out[len] = '\0';
+  return len;
+}
+
+static void checkCopy(const char *input, size_t size)
+{
+  uint8_t buffer[260];
+  memset(buffer, CANARY, sizeof(buffer));
+  size_t len = utf8Copy((char *)buffer, size, input);
+  CHECK(len < size);
+  CHECK(buffer[len] == '\0');
+  CHECK(strlen((char *)buffer) == len);
+  for (size_t i = size; i < sizeof(buffer); i++)
+    CHECK(buffer[i] == CANARY);
+  CHECK(validUtf8(buffer, len));
+  for (size_t i = 0; i < len; i++)
+    CHECK(buffer[i] >= 0x20 && buffer[i] != 0x7F);
+
+  char again[260];
+  CHECK(utf8Copy(again, size, (char *)buffer) == len);
+  CHECK(memcmp(again, buffer, len + 1) == 0);
+
+  // A larger buffer never gives back less, and a cut lands on a code
+  // point boundary of the full copy
+  char full[260];
+  size_t fullLen = utf8Copy(full, sizeof(full), input);
+  CHECK(fullLen >= len);
+  CHECK(memcmp(full, buffer, len) == 0);
+  CHECK(len == fullLen || ((uint8_t)full[len] & 0xC0) != 0x80);
+}
+
+static void checkDisplay(const char *input, size_t size)
+{
+  uint8_t buffer[260];
+  memset(buffer, CANARY, sizeof(buffer));
+  size_t len = displayText((char *)buffer, size, input);
+  CHECK(len < size);
+  CHECK(buffer[len] == '\0');
+  CHECK(strlen((char *)buffer) == len);
+  for (size_t i = size; i < sizeof(buffer); i++)
+    CHECK(buffer[i] == CANARY);
+  for (size_t i = 0; i < len; i++)
+    CHECK(buffer[i] >= 0x20 && buffer[i] != 0x7F);
+}
+
+static void expectCopy(const char *input, const char *expected)
+{
+  char out[64];
+  utf8Copy(out, sizeof(out), input);
+  if (strcmp(out, expected) != 0)
+  {
+    fprintf(stderr, "utf8Copy(\"%s\") gave \"%s\", expected \"%s\"\n", input, out, expected);
+    exit(1);
+  }
+}
+
+static void expectDisplay(const char *input, const char *expected)
+{
+  char out[64];
+  displayText(out, sizeof(out), input);
+  if (strcmp(out, expected) != 0)
+  {
+    fprintf(stderr, "displayText(\"%s\") gave \"%s\", expected \"%s\"\n", input, out, expected);
+    exit(1);
+  }
+}
+
+// Latin-1 text whose bytes never happen to form UTF-8 decodes back to the
+// same code points
+static void checkLatin1RoundTrip(const char *input)
+{
+  const uint8_t *p = (const uint8_t *)input;
+  size_t inputLen = strlen(input);
+  for (size_t i = 0; i + 1 < inputLen; i++)
+    if (p[i] >= 0xC2 && p[i] <= 0xF4 && (p[i + 1] & 0xC0) == 0x80)
+      return;
+
+  char out[260];
+  size_t len = utf8Copy(out, sizeof(out), input);
+  size_t at = 0;
+  for (size_t i = 0; i < inputLen; i++)
+  {
+    CHECK(at < len);
+    uint32_t cp;
+    at += utf8Decode(out + at, len - at, &cp);
+    uint32_t expected = p[i] < 0x20 || p[i] == 0x7F ? ' ' : p[i];
+    CHECK(cp == expected);
+  }
+  CHECK(at == len);
+}
+
+int main()
+{
+  expectCopy("caf\xe9", "caf\xc3\xa9");
+  expectCopy("Beyonc\xe9", "Beyonc\xc3\xa9");
+  expectCopy("Se\xf1", "Se\xc3\xb1");
+  expectCopy("Se\xf1or", "Se\xc3\xb1or");
+  expectCopy("M\xf6tley Cr\xfc\x65", "M\xc3\xb6tley Cr\xc3\xbc\x65");
+  expectCopy("caf\xc3\xa9", "caf\xc3\xa9");
+  expectCopy("cut \xe2\x80", "cut ");
+  expectCopy("cut \xf0\x9f\x8e", "cut ");
+  expectCopy("bad \xe0\x80", "bad \xc3\xa0\xc2\x80");
+  expectCopy("bad \xed\xa0\x80", "bad \xc3\xad\xc2\xa0\xc2\x80");
+  expectCopy("tab\there", "tab here");
+
+  expectDisplay("caf\xc3\xa9", "caf\x82");
+  expectDisplay("Beyonc\xe9", "Beyonc\x82");
+  expectDisplay("\xe2\x80\x9cHi\xe2\x80\x9d \xe2\x80\x93 \xe2\x80\xa6", "\"Hi\" - ...");
+  expectDisplay("\xc5\x81\xc3\xb3\x64\xc5\xba", "L\xa2\x64z");
+  expectDisplay("Stra\xc3\x9f\x65", "Stra\xe1\x65");
+  expectDisplay("\xc5\x92uvre \xe2\x82\xac", "OEuvre EUR");
+  expectDisplay("e\xcc\x81", "e");
+  expectDisplay("\xe6\x97\xa5", "?");
+  expectDisplay("\xf0\x9f\x8e\xb5 x", "? x");
+
+  {
+    char small[4];
+    CHECK(utf8Copy(small, sizeof(small), "a\xc3\xa9\xc3\xa9") == 3);
+    CHECK(strcmp(small, "a\xc3\xa9") == 0);
+    CHECK(utf8Copy(small, sizeof(small), "ab\xc3\xa9") == 2);
+    CHECK(strcmp(small, "ab") == 0);
+    CHECK(displayText(small, sizeof(small), "a\xe2\x80\xa6") == 1);
+    CHECK(strcmp(small, "a") == 0);
+  }
+
+  char input[MAX_INPUT + 1];
+  for (int i = 0; i < ITERATIONS; i++)
+  {
+    randomInput(input);
+    size_t size = 1 + nextRandom() % 256;
+    checkCopy(input, size);
+    checkDisplay(input, size);
+    checkLatin1RoundTrip(input);
+  }
+
+  printf("utf8text fuzz ok\n");
+  return 0;
+}
@@ -0,0 +1,17 @@
+# 100k UI-style requests; fails if the largest free heap block shrank or
+# the pool ran dry. The no-allocation check itself runs on the host:
+# make -C test/host
+metric() { curl -s http://aradio.local/metrics | awk -v name="$1" '$1 == name { print $2 }'; }
+BEFORE=$(metric heap_largest_block)
+for i in $(seq 1 100000); do
+  echo "url = \"http://aradio.local/status\""
+done | curl -s -o /dev/null --parallel --parallel-max 4 -K -
+sleep 2
+AFTER=$(metric heap_largest_block)
+MISSES=$(metric http_pool_misses)
+echo "heap_largest_block $BEFORE -> $AFTER, http_pool_misses $MISSES"
+# AsyncWebServer's own request objects come and go, allow 1 KiB of slack
+if [ "$AFTER" -lt $((BEFORE - 1024)) ]; then
+  echo "FAIL: largest free block shrank"
+  exit 1
+fi
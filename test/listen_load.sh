@@ -0,0 +1,7 @@
+# 8 concurrent listeners for 60 s; each should average >= 16000 B/s (128 kbps)
+for i in $(seq 1 8); do
+  curl -s -o /dev/null -w "listener $i: %{size_download} bytes, %{speed_download} B/s\n" --max-time 60 http://aradio.local/listen &
+done
+wait
+curl http://aradio.local/metrics | grep listen_
+
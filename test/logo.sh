@@ -0,0 +1,13 @@
+curl "http://aradio.local/play?url=https%3A%2F%2Fshoutcast.ccma.cat%2Fccma%2FicatHD.mp3&logo=https%3A%2F%2Fstatics.ccma.cat%2Fmultimedia%2Fpng%2F4%2F6%2F1597311290164.png"
+sleep 5
+curl -s -o /tmp/logo.bmp -w "%{http_code} %{size_download} bytes\n" http://aradio.local/logo
+file /tmp/logo.bmp
+
+# The playing station's logo by URL: 202 while it is fetched, then the BMP
+SRC="https%3A%2F%2Fstatics.ccma.cat%2Fmultimedia%2Fpng%2F4%2F6%2F1597311290164.png"
+curl -s -o /dev/null -w "%{http_code}\n" "http://aradio.local/logo?src=$SRC"
+sleep 3
+curl -s -o /dev/null -w "%{http_code} %{size_download} bytes\n" "http://aradio.local/logo?src=$SRC"
+
+# Logos of stations that were not played are refused
+curl -s -o /dev/null -w "%{http_code}\n" "http://aradio.local/logo?src=https%3A%2F%2Fexample.com%2Fother.png"
@@ -0,0 +1 @@
+curl http://aradio.local/metrics
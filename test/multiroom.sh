@@ -0,0 +1,3 @@
+curl http://aradio-leader.local/multiroom?role=leader
+curl http://aradio-follower.local/multiroom?role=follower
+
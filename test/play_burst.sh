@@ -0,0 +1,7 @@
+# 10 station changes in a row: only the last should play, extra requests get 429
+for i in $(seq 1 10); do
+  curl -s -o /dev/null -w "%{http_code}\n" "http://aradio.local/play?url=https%3A%2F%2Fshoutcast.ccma.cat%2Fccma%2FicatHD.mp3"
+done
+sleep 2
+curl -s http://aradio.local/metrics | grep -E "control_|http_rate_limited"
+
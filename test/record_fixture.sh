@@ -0,0 +1,21 @@
+# Record a benchmark fixture with its ICY metadata left in:
+#   ./record_fixture.sh <label> <stream url> [seconds]
+# --http0.9 lets curl take SHOUTcast v1 "ICY 200 OK" responses.
+# Writes data/fixtures/<label>.<icy-metaint>.<ext>; upload with pio run -e benchmark -t uploadfs
+LABEL=$1
+URL=$2
+DURATION=${3:-30}
+mkdir -p data/fixtures
+HEADERS=$(curl -s -L --http0.9 -D - -o /tmp/fixture.raw --max-time "$DURATION" -H "Icy-MetaData: 1" "$URL")
+METAINT=$(echo "$HEADERS" | tr -d '\r' | grep -i '^icy-metaint:' | tail -1 | cut -d: -f2 | tr -d ' ')
+TYPE=$(echo "$HEADERS" | tr -d '\r' | grep -i '^content-type:' | tail -1 | cut -d: -f2 | tr -d ' ')
+case "$TYPE" in
+  audio/aac|audio/aacp) EXT=aac ;;
+  audio/mp4) EXT=m4a ;;
+  audio/flac) EXT=flac ;;
+  audio/ogg|application/ogg) EXT=ogg ;;
+  *) EXT=mp3 ;;
+esac
+mv /tmp/fixture.raw "data/fixtures/$LABEL.${METAINT:-0}.$EXT"
+ls -l "data/fixtures/$LABEL.${METAINT:-0}.$EXT"
+
@@ -0,0 +1,6 @@
+curl http://aradio.local/recordings
+# Download the first recording, then delete it
+ID=$(curl -s http://aradio.local/recordings | grep -o '"id":[0-9]*' | head -1 | cut -d: -f2)
+curl -o recording-$ID.bin http://aradio.local/recording?id=$ID
+curl "http://aradio.local/recording?id=$ID&delete"
+
@@ -0,0 +1,2 @@
+curl http://aradio.local/resume
+
@@ -0,0 +1,3 @@
+# Fade out over the last minute and stop in 30 min; minutes=0 cancels
+curl "http://aradio.local/sleep?minutes=30&fade=60"
+
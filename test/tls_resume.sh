@@ -0,0 +1,21 @@
+# Local HTTPS stand-in: serves ./sample.mp3 with session tickets enabled.
+# Play it twice; the second connect should log "resumed" and bump tls_resumed.
+openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=standin -keyout /tmp/standin.key -out /tmp/standin.crt -days 1 2>/dev/null
+python3 -c '
+import http.server, ssl
+ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+ctx.maximum_version = ssl.TLSVersion.TLSv1_2
+ctx.load_cert_chain("/tmp/standin.crt", "/tmp/standin.key")
+server = http.server.HTTPServer(("", 8443), http.server.SimpleHTTPRequestHandler)
+server.socket = ctx.wrap_socket(server.socket, server_side=True)
+server.serve_forever()' &
+STANDIN=$!
+sleep 1
+HOST=$(hostname -I | cut -d" " -f1)
+for i in 1 2 3; do
+  curl -s "http://aradio.local/play?url=https://$HOST:8443/sample.mp3"
+  sleep 5
+done
+curl -s http://aradio.local/metrics | grep tls_
+kill $STANDIN
+
@@ -31,6 +31,7 @@ import Box from '@mui/material/Box';
 import Alert from '@mui/material/Alert';
 
 import { StationBox } from './StationBox';
+import { DeviceLogo } from './DeviceLogo';
 
 const localStorageFavouritesKey = 'favourites';
 const uiDebounceTime = 500;
@@ -56,6 +57,7 @@ export function App() {
   const [isLoading, setIsLoading] = useState<boolean>(false);
   const [isPlaying, setIsPlaying] = useState<boolean>(false);
   const [currentStationName, setCurrentStationName] = useState<string>('');
+  const [currentLogo, setCurrentLogo] = useState<string>('');
   const [currentStationTitle, setCurrentStationTitle] = useState<string>('');
   const [cmdIsLoading, setCmdIsLoading] = useState<boolean>(false);
   const [snackbar, setSnackbar] = useState<{
@@ -97,9 +99,13 @@ export function App() {
     });
   };
 
-  const playStream = async (url: string) => {
+  const playStream = async (url: string, logo: string = '') => {
     try {
-      await doFetch(`/play?url=${encodeURIComponent(url)}`);
+      // The radio fetches and thumbnails the logo once; we then show its copy
+      await doFetch(
+        `/play?url=${encodeURIComponent(url)}&logo=${encodeURIComponent(logo)}`
+      );
+      setCurrentLogo(logo);
     } catch (error) {
       showMessage(`Error playing stream`, true);
       console.log('Error playing stream:', error);
@@ -312,6 +318,9 @@ export function App() {
             </Box>
           </Stack>
           <Typography variant='subtitle1' sx={{ pt: 2, textAlign: 'center' }}>
+            {isPlaying && currentLogo && (
+              <DeviceLogo radioBaseUrl={radioBaseUrl} src={currentLogo} size={48} />
+            )}
             {isPlaying ? currentStationName + ' ' + currentStationTitle : ''}
           </Typography>
           <Stack direction='column' spacing={1}>
@@ -0,0 +1,73 @@
+import { useEffect, useState } from 'react';
+
+const maxAttempts = 10;
+
+// The current station's artwork, served from the radio's logo cache instead
+// of the station's own server. The radio answers 202 while it is still
+// fetching and 503 while its queue is full, so keep asking with a growing
+// delay. It only serves logos of stations it has played recently.
+export function DeviceLogo({
+  radioBaseUrl,
+  src,
+  size,
+}: {
+  radioBaseUrl: string;
+  src: string;
+  size: number;
+}) {
+  const [objectUrl, setObjectUrl] = useState('');
+
+  useEffect(() => {
+    if (!src) return;
+    let cancelled = false;
+    let timer: ReturnType<typeof setTimeout> | undefined;
+    let loadedUrl = '';
+
+    const retry = (attempt: number) => {
+      if (!cancelled && attempt + 1 < maxAttempts)
+        timer = setTimeout(() => load(attempt + 1), Math.min(1000 * (attempt + 1), 5000));
+    };
+
+    const load = async (attempt: number) => {
+      try {
+        const response = await fetch(
+          `${radioBaseUrl}/logo?src=${encodeURIComponent(src)}`
+        );
+        if (cancelled) return;
+        if (response.status === 200) {
+          const blob = await response.blob();
+          if (cancelled) return;
+          loadedUrl = URL.createObjectURL(blob);
+          setObjectUrl(loadedUrl);
+        } else if (response.status === 202 || response.status === 503) {
+          retry(attempt);
+        }
+      } catch {
+        retry(attempt);
+      }
+    };
+
+    setObjectUrl('');
+    load(0);
+    return () => {
+      cancelled = true;
+      clearTimeout(timer);
+      if (loadedUrl) URL.revokeObjectURL(loadedUrl);
+    };
+  }, [radioBaseUrl, src]);
+
+  if (!objectUrl) return null;
+  return (
+    <img
+      src={objectUrl}
+      style={{
+        width: size,
+        height: size,
+        marginRight: 8,
+        verticalAlign: 'middle',
+        borderRadius: '30%',
+      }}
+      alt=''
+    />
+  );
+}
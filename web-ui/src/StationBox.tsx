@@ -31,7 +31,7 @@ export function StationBox({
   isFavourite: boolean;
   onAddFavorites: (station: Station) => void;
   onRemoveFavourites: (stationId: string) => void;
-  onPlayStreamURL: (url: string) => void;
+  onPlayStreamURL: (url: string, logo: string) => void;
 }) {
   return (
     <Paper key={station.id} sx={{ p: 1 }}>
@@ -70,7 +70,9 @@ export function StationBox({
         <Button
           variant='outlined'
           size='small'
-          onClick={() => onPlayStreamURL(station.urlResolved || station.url)}
+          onClick={() =>
+            onPlayStreamURL(station.urlResolved || station.url, station.favicon)
+          }
         >
           Listen
         </Button>